@@ -43,6 +43,14 @@ typedef enum {
 
 
 
+/* Output pixel formats (JDEC.format) */
+#define JD_FMT_RGB888	1	/* 24-bit/pix: R, G, B bytes (B, G, R with JDEC.swap) */
+#define JD_FMT_RGB565	2	/* 16-bit/pix: RRRRRGGGGGGBBBBB native word (byte swapped with JDEC.swap) */
+#define JD_FMT_GRAY		3	/* 8-bit/pix: luminance */
+#define JD_FMT_ARGB8888	4	/* 32-bit/pix: 0xFFRRGGBB native word, opaque (byte reversed with JDEC.swap) */
+
+
+
 /* Rectangular region in the output image */
 typedef struct {
 	uint16_t left;		/* Left end */
@@ -53,6 +61,14 @@ typedef struct {
 
 
 
+/* Coefficient block handed from the entropy decoding stage to the IDCT stage */
+typedef struct {
+	int32_t coef[64];	/* De-quantized coefficients in raster order */
+	uint8_t nz[2];		/* Non-zero column maps (nz[0] == 0: DC element only) */
+} JBLOCK;
+
+
+
 /* Decompressor object structure */
 typedef struct JDEC JDEC;
 struct JDEC {
@@ -75,7 +91,7 @@ struct JDEC {
 	uint32_t wreg;				/* Working shift register */
 	uint8_t marker;				/* Detected marker (0:None) */
 #if JD_FASTDECODE == 2
-	uint8_t longofs[2][2];		/* Table offset of long code [id][dcac] */
+	uint16_t longofs[2][2];		/* Table offset of long code [id][dcac] */
 	uint16_t* hufflut_ac[2];	/* Fast huffman decode tables for AC short code [id] */
 	uint8_t* hufflut_dc[2];		/* Fast huffman decode tables for DC short code [id] */
 #endif
@@ -86,7 +102,16 @@ struct JDEC {
 	size_t sz_pool;				/* Size of momory pool (bytes available) */
 	size_t (*infunc)(JDEC*, uint8_t*, size_t);	/* Pointer to jpeg stream input function */
 	void* device;				/* Pointer to I/O device identifiler for the session */
+	uint8_t* dstbuf;			/* Frame buffer for direct output (0:output via outfunc only) */
+	int32_t dstdx, dstdy;		/* Distance in the frame buffer between horizontally/vertically adjacent pixels of the picture (bytes) */
 	uint8_t swap;       /* Added by Bodmer to control byte swapping */
+	uint8_t nolut;				/* 1:Do not build the huffman decode tables (JD_FASTDECODE == 2), kept by jd_prepare like swap */
+	size_t szbuf;				/* Size of the stream input buffer taken from the pool (0:JD_SZBUF), kept by jd_prepare like swap */
+	uint8_t format;				/* Output pixel format (JD_FMT_*, 0:JD_FORMAT of the build), kept by jd_prepare like swap; may be changed after it to a format of no more bytes per pixel */
+	uint8_t orient;				/* Orientation of the picture in the frame buffer (EXIF code 2..8, 0/1:as stored; outfunc gets it as stored), kept by jd_prepare like swap */
+	uint32_t ldmcu;				/* Step-wise/pipelined decompression: next MCU to load (entropy decoding stage) */
+	uint32_t outmcu;			/* Step-wise/pipelined decompression: next MCU to output (IDCT stage) */
+	JRECT crop;					/* Step-wise/pipelined decompression: output window in descaled pixels, placed at the top-left of the frame buffer */
 };
 
 
@@ -94,6 +119,14 @@ struct JDEC {
 /* TJpgDec API functions */
 JRESULT jd_prepare (JDEC* jd, size_t (*infunc)(JDEC*,uint8_t*,size_t), void* pool, size_t sz_pool, void* dev);
 JRESULT jd_decomp (JDEC* jd, int (*outfunc)(JDEC*,void*,JRECT*), uint8_t scale);
+JRESULT jd_decomp_to_buffer (JDEC* jd, int (*outfunc)(JDEC*,void*,JRECT*), uint8_t* dst, size_t stride, uint8_t scale);
+JRESULT jd_decomp_part (JDEC* jd, int (*outfunc)(JDEC*,void*,JRECT*), uint8_t* dst, size_t stride, uint8_t scale, uint32_t first, uint32_t count);
+JRESULT jd_decomp_start (JDEC* jd, uint8_t* dst, size_t stride, uint8_t scale);
+JRESULT jd_decomp_start_crop (JDEC* jd, uint8_t* dst, size_t stride, uint8_t scale, const JRECT* crop);
+JRESULT jd_decomp_step (JDEC* jd, int (*outfunc)(JDEC*,void*,JRECT*), uint32_t count);
+JRESULT jd_pipe_load (JDEC* jd, JBLOCK* blk);
+JRESULT jd_pipe_idct (JDEC* jd, JBLOCK* blk);
+JRESULT jd_pipe_output (JDEC* jd, JBLOCK* blk, int (*outfunc)(JDEC*,void*,JRECT*));
 
 
 #ifdef __cplusplus
@@ -1,37 +1,80 @@
 /*----------------------------------------------*/
 /* TJpgDec System Configurations R0.03          */
 /*----------------------------------------------*/
+/* Each option may be overridden from the build system (e.g. -DJD_FASTDECODE=2) */
 
+#ifndef JD_SZBUF
 #define	JD_SZBUF		512
-/* Specifies size of stream input buffer */
+#endif
+/* Specifies default size of stream input buffer, used when JDEC.szbuf is 0.
+/  A larger buffer set in JDEC.szbuf takes as much more of the work area and
+/  cuts the number of input function calls */
 
+#ifndef JD_FORMAT
 #define JD_FORMAT		1
-/* Specifies output pixel format.
+#endif
+/* Specifies the default output pixel format, used when JDEC.format is 0.
 /  0: RGB888 (24-bit/pix)
 /  1: RGB565 (16-bit/pix)
 /  2: Grayscale (8-bit/pix)
+/  3: ARGB8888 (32-bit/pix)
+/  Every format can be selected at run time with JDEC.format (JD_FMT_*).
 */
 
+#ifndef JD_USE_SCALE
 #define	JD_USE_SCALE	1
+#endif
 /* Switches output descaling feature.
 /  0: Disable
 /  1: Enable
 */
 
+#ifndef JD_TBLCLIP
 #define JD_TBLCLIP		0
+#endif
 /* Use table conversion for saturation arithmetic. A bit faster, but increases 1 KB of code size.
 /  0: Disable
 /  1: Enable
 */
 
-#define JD_FASTDECODE	1
+#ifndef JD_TBLCOLOR
+#define JD_TBLCOLOR		1
+#endif
+/* Use tables of the Cb/Cr contributions for YCbCr to RGB conversion instead of
+/  multiplications. Pairs with JD_TBLCLIP for the clipping. Increases 3 KB of code size.
+/  0: Disable
+/  1: Enable
+*/
+
+#ifndef JD_FASTDECODE
+#define JD_FASTDECODE	2
+#endif
 /* Optimization level
 /  0: Basic optimization. Suitable for 8/16-bit MCUs.
 /     Workspace of 3100 bytes needed.
 /  1: + 32-bit barrel shifter. Suitable for 32-bit MCUs.
 /     Workspace of 3480 bytes needed.
 /  2: + Table conversion for huffman decoding (wants 6 << HUFF_BIT bytes of RAM).
-/     Workspace of 9644 bytes needed.
+/     Workspace of 9644 bytes needed. The tables can be turned off at run time with
+/     JDEC.nolut, the workspace needed is then the same as level 1.
+*/
+
+#ifndef JD_FASTRGB565
+#define JD_FASTRGB565	1
+#endif
+/* Direct YCbCr to output pixel kernels (RGB565 and every other format).
+/  0: Build an RGB888 (or grayscale) MCU, squeeze it and convert it to the output format in place.
+/  1: Convert the Y/Cb/Cr blocks straight into clipped output pixels in one pass.
+*/
+
+#ifndef JD_SPARSEIDCT
+#define JD_SPARSEIDCT	1
+#endif
+/* Sparse block shortcuts in the 8x8 IDCT.
+/  0: Always run the full column and row butterflies.
+/  1: Track the non-zero coefficients of each block while huffman decoding, skip zero
+/     columns, spread DC-only columns and skip the odd part or the whole row pass when
+/     the corresponding coefficients are zero.
 */
 
 // Do not change this, it is the minimum size in bytes of the workspace needed by the decoder
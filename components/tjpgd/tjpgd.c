@@ -27,6 +27,9 @@
 #include "tjpgd.h"
 
 
+#define JD_BPP(fmt)	((fmt) == JD_FMT_RGB888 ? 3 : (fmt) == JD_FMT_RGB565 ? 2 : (fmt) == JD_FMT_GRAY ? 1 : 4)	/* Bytes per output pixel */
+
+
 #if JD_FASTDECODE == 2
 #define HUFF_BIT	10	/* Bit length to apply fast huffman decode */
 #define HUFF_LEN	(1 << HUFF_BIT)
@@ -125,6 +128,34 @@ static uint8_t BYTECLIP (int val)
 
 
 
+#if JD_TBLCOLOR
+/*---------------------------------------------*/
+/* Conversion tables for YCbCr to RGB          */
+/*---------------------------------------------*/
+
+/* Chroma contributions indexed by the Cb/Cr sample, with the arithmetic of the
+/  per-pixel conversion at 32-bit accuracy: R and B contributions are final, the
+/  two G terms are summed before the division so that the result is unchanged. */
+
+#define	TBL4(f, i)		f(i), f((i) + 1), f((i) + 2), f((i) + 3)
+#define	TBL16(f, i)		TBL4(f, i), TBL4(f, (i) + 4), TBL4(f, (i) + 8), TBL4(f, (i) + 12)
+#define	TBL64(f, i)		TBL16(f, i), TBL16(f, (i) + 16), TBL16(f, (i) + 32), TBL16(f, (i) + 48)
+#define	TBL256(f)		TBL64(f, 0), TBL64(f, 64), TBL64(f, 128), TBL64(f, 192)
+
+#define	CR_R(c)	(int16_t)((int32_t)(1.402 * 1024) * ((c) - 128) / 1024)
+#define	CB_B(c)	(int16_t)((int32_t)(1.772 * 1024) * ((c) - 128) / 1024)
+#define	CB_G(c)	(int32_t)(0.344 * 1024) * ((c) - 128)
+#define	CR_G(c)	(int32_t)(0.714 * 1024) * ((c) - 128)
+
+static const int16_t CrR[256] = { TBL256(CR_R) };
+static const int16_t CbB[256] = { TBL256(CB_B) };
+static const int32_t CbG[256] = { TBL256(CB_G) };
+static const int32_t CrG[256] = { TBL256(CR_G) };
+
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Allocate a memory block from memory pool                              */
 /*-----------------------------------------------------------------------*/
@@ -197,10 +228,10 @@ static JRESULT create_huffman_tbl (	/* 0:OK, !0:Failed */
 	size_t ndata				/* Size of input data */
 )
 {
-	unsigned int i, j, b, cls, num;
+	unsigned int i, j, b, cls, num, hc;
 	size_t np;
 	uint8_t d, *pb, *pd;
-	uint16_t hc, *ph;
+	uint16_t *ph;
 
 
 	while (ndata) {	/* Process all tables in the segment */
@@ -218,10 +249,12 @@ static JRESULT create_huffman_tbl (	/* 0:OK, !0:Failed */
 		ph = alloc_pool(jd, np * sizeof (uint16_t));/* Allocate a memory block for the code word table */
 		if (!ph) return JDR_MEM1;			/* Err: not enough memory */
 		jd->huffcode[num][cls] = ph;
+		if (np > 256) return JDR_FMT1;		/* Err: too many code words */
 		hc = 0;
 		for (j = i = 0; i < 16; i++) {		/* Re-build huffman code word table */
 			b = pb[i];
-			while (b--) ph[j++] = hc++;
+			while (b--) ph[j++] = (uint16_t)hc++;
+			if (hc > 1U << (i + 1)) return JDR_FMT1;	/* Err: code words overflow the code space of this length */
 			hc <<= 1;
 		}
 
@@ -236,7 +269,7 @@ static JRESULT create_huffman_tbl (	/* 0:OK, !0:Failed */
 			pd[i] = d;
 		}
 #if JD_FASTDECODE == 2
-		{	/* Create fast huffman decode table */
+		if (!jd->nolut) {	/* Create fast huffman decode table */
 			unsigned int span, td, ti;
 			uint16_t *tbl_ac = 0;
 			uint8_t *tbl_dc = 0;
@@ -247,7 +280,7 @@ static JRESULT create_huffman_tbl (	/* 0:OK, !0:Failed */
 				jd->hufflut_ac[num] = tbl_ac;
 				memset(tbl_ac, 0xFF, HUFF_LEN * sizeof (uint16_t));		/* Default value (0xFFFF: may be long code) */
 			} else {
-				tbl_dc = alloc_pool(jd, HUFF_LEN * sizeof (uint8_t));	/* LUT for AC elements */
+				tbl_dc = alloc_pool(jd, HUFF_LEN * sizeof (uint8_t));	/* LUT for DC elements */
 				if (!tbl_dc) return JDR_MEM1;		/* Err: not enough memory */
 				jd->hufflut_dc[num] = tbl_dc;
 				memset(tbl_dc, 0xFF, HUFF_LEN * sizeof (uint8_t));		/* Default value (0xFF: may be long code) */
@@ -302,7 +335,7 @@ static int huffext (	/* >=0: decoded data, <0: error code */
 		if (!bm) {		/* Next byte? */
 			if (!dc) {	/* No input data is available, re-fill input buffer */
 				dp = jd->inbuf;	/* Top of input buffer */
-				dc = jd->infunc(jd, dp, JD_SZBUF);
+				dc = jd->infunc(jd, dp, jd->szbuf);
 				if (!dc) return 0 - (int)JDR_INP;	/* Err: read error or wrong stream termination */
 			} else {
 				dp++;	/* Next data ptr */
@@ -340,13 +373,19 @@ static int huffext (	/* >=0: decoded data, <0: error code */
 	uint32_t w = jd->wreg & ((1UL << wbit) - 1);
 
 
+	if (wbit < 16 && !jd->marker) {	/* Fast path: fill up to 31 bits with the bytes up to the next 0xFF */
+		while (wbit < 24 && dc && *dp != 0xFF) {
+			w = w << 8 | *dp++; dc--;
+			wbit += 8;
+		}
+	}
 	while (wbit < 16) {	/* Prepare 16 bits into the working register */
 		if (jd->marker) {
 			d = 0xFF;	/* Input stream has stalled for a marker. Generate stuff bits */
 		} else {
 			if (!dc) {	/* Buffer empty, re-fill input buffer */
 				dp = jd->inbuf;						/* Top of input buffer */
-				dc = jd->infunc(jd, dp, JD_SZBUF);
+				dc = jd->infunc(jd, dp, jd->szbuf);
 				if (!dc) return 0 - (int)JDR_INP;	/* Err: read error or wrong stream termination */
 			}
 			d = *dp++; dc--;
@@ -367,34 +406,37 @@ static int huffext (	/* >=0: decoded data, <0: error code */
 	jd->wreg = w;
 
 #if JD_FASTDECODE == 2
-	/* Table serch for the short codes */
-	d = (unsigned int)(w >> (wbit - HUFF_BIT));	/* Short code as table index */
-	if (cls) {	/* AC element */
-		d = jd->hufflut_ac[id][d];	/* Table decode */
-		if (d != 0xFFFF) {	/* It is done if hit in short code */
-			jd->dbit = wbit - (d >> 8);	/* Snip the code length */
-			return d & 0xFF;	/* b7..0: zero run and following data bits */
-		}
-	} else {	/* DC element */
-		d = jd->hufflut_dc[id][d];	/* Table decode */
-		if (d != 0xFF) {	/* It is done if hit in short code */
-			jd->dbit = wbit - (d >> 4);	/* Snip the code length  */
-			return d & 0xF;	/* b3..0: following data bits */
+	if (!jd->nolut) {
+		/* Table serch for the short codes */
+		d = (unsigned int)(w >> (wbit - HUFF_BIT));	/* Short code as table index */
+		if (cls) {	/* AC element */
+			d = jd->hufflut_ac[id][d];	/* Table decode */
+			if (d != 0xFFFF) {	/* It is done if hit in short code */
+				jd->dbit = wbit - (d >> 8);	/* Snip the code length */
+				return d & 0xFF;	/* b7..0: zero run and following data bits */
+			}
+		} else {	/* DC element */
+			d = jd->hufflut_dc[id][d];	/* Table decode */
+			if (d != 0xFF) {	/* It is done if hit in short code */
+				jd->dbit = wbit - (d >> 4);	/* Snip the code length  */
+				return d & 0xF;	/* b3..0: following data bits */
+			}
 		}
-	}
 
-	/* Incremental serch for the codes longer than HUFF_BIT */
-	hb = jd->huffbits[id][cls] + HUFF_BIT;				/* Bit distribution table */
-	hc = jd->huffcode[id][cls] + jd->longofs[id][cls];	/* Code word table */
-	hd = jd->huffdata[id][cls] + jd->longofs[id][cls];	/* Data table */
-	bl = HUFF_BIT + 1;
-#else
-	/* Incremental serch for all codes */
-	hb = jd->huffbits[id][cls];	/* Bit distribution table */
-	hc = jd->huffcode[id][cls];	/* Code word table */
-	hd = jd->huffdata[id][cls];	/* Data table */
-	bl = 1;
+		/* Incremental serch for the codes longer than HUFF_BIT */
+		hb = jd->huffbits[id][cls] + HUFF_BIT;				/* Bit distribution table */
+		hc = jd->huffcode[id][cls] + jd->longofs[id][cls];	/* Code word table */
+		hd = jd->huffdata[id][cls] + jd->longofs[id][cls];	/* Data table */
+		bl = HUFF_BIT + 1;
+	} else
 #endif
+	{
+		/* Incremental serch for all codes */
+		hb = jd->huffbits[id][cls];	/* Bit distribution table */
+		hc = jd->huffcode[id][cls];	/* Code word table */
+		hd = jd->huffdata[id][cls];	/* Data table */
+		bl = 1;
+	}
 	for ( ; bl <= 16; bl++) {	/* Incremental search */
 		nc = *hb++;
 		if (nc) {
@@ -437,7 +479,7 @@ static int bitext (	/* >=0: extracted data, <0: error code */
 		if (!mbit) {			/* Next byte? */
 			if (!dc) {			/* No input data is available, re-fill input buffer */
 				dp = jd->inbuf;	/* Top of input buffer */
-				dc = jd->infunc(jd, dp, JD_SZBUF);
+				dc = jd->infunc(jd, dp, jd->szbuf);
 				if (!dc) return 0 - (int)JDR_INP;	/* Err: read error or wrong stream termination */
 			} else {
 				dp++;			/* Next data ptr */
@@ -468,13 +510,19 @@ static int bitext (	/* >=0: extracted data, <0: error code */
 	uint32_t w = jd->wreg & ((1UL << wbit) - 1);
 
 
+	if (wbit < nbit && !jd->marker) {	/* Fast path: fill up to 31 bits with the bytes up to the next 0xFF */
+		while (wbit < 24 && dc && *dp != 0xFF) {
+			w = w << 8 | *dp++; dc--;
+			wbit += 8;
+		}
+	}
 	while (wbit < nbit) {	/* Prepare nbit bits into the working register */
 		if (jd->marker) {
 			d = 0xFF;	/* Input stream stalled, generate stuff bits */
 		} else {
 			if (!dc) {	/* Buffer empty, re-fill input buffer */
 				dp = jd->inbuf;	/* Top of input buffer */
-				dc = jd->infunc(jd, dp, JD_SZBUF);
+				dc = jd->infunc(jd, dp, jd->szbuf);
 				if (!dc) return 0 - (int)JDR_INP;	/* Err: read error or wrong stream termination */
 			}
 			d = *dp++; dc--;
@@ -521,7 +569,7 @@ static JRESULT restart (
 	for (i = 0; i < 2; i++) {
 		if (!dc) {	/* No input data is available, re-fill input buffer */
 			dp = jd->inbuf;
-			dc = jd->infunc(jd, dp, JD_SZBUF);
+			dc = jd->infunc(jd, dp, jd->szbuf);
 			if (!dc) return JDR_INP;
 		} else {
 			dp++;
@@ -548,7 +596,7 @@ static JRESULT restart (
 		for (i = 0; i < 2; i++) {	/* Get a restart marker */
 			if (!dc) {		/* No input data is available, re-fill input buffer */
 				dp = jd->inbuf;
-				dc = jd->infunc(jd, dp, JD_SZBUF);
+				dc = jd->infunc(jd, dp, jd->szbuf);
 				if (!dc) return JDR_INP;
 			}
 			marker = (marker << 8) | *dp++;	/* Get a byte */
@@ -578,16 +626,28 @@ static JRESULT restart (
 
 static void block_idct (
 	int32_t* src,	/* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
-	jd_yuv_t* dst	/* Pointer to the destination to store the block as byte array */
+	jd_yuv_t* dst,	/* Pointer to the destination to store the block as byte array */
+	uint8_t nzc,	/* Columns having any non-zero element (bit0:column 0 ... bit7:column 7) */
+	uint8_t nzac	/* Columns having any non-zero element in rows 1..7 */
 )
 {
 	const int32_t M13 = (int32_t)(1.41421*4096), M2 = (int32_t)(1.08239*4096), M4 = (int32_t)(2.61313*4096), M5 = (int32_t)(1.84776*4096);
 	int32_t v0, v1, v2, v3, v4, v5, v6, v7;
 	int32_t t10, t11, t12, t13;
-	int i;
+	int i, n;
 
 	/* Process columns */
 	for (i = 0; i < 8; i++) {
+		if (JD_SPARSEIDCT && !(nzac & 1 << i)) {	/* Only the DC element (or nothing) in this column? */
+			if (nzc & 1 << i) {		/* Spread the DC element over the column */
+				v0 = src[8 * 0];
+				src[8 * 1] = v0; src[8 * 2] = v0; src[8 * 3] = v0;
+				src[8 * 4] = v0; src[8 * 5] = v0; src[8 * 6] = v0; src[8 * 7] = v0;
+			}						/* An all-zero column stays all-zero */
+			src++;
+			continue;
+		}
+
 		v0 = src[8 * 0];	/* Get even elements */
 		v1 = src[8 * 2];
 		v2 = src[8 * 4];
@@ -634,7 +694,19 @@ static void block_idct (
 
 	/* Process rows */
 	src -= 8;
-	for (i = 0; i < 8; i++) {
+	n = (JD_SPARSEIDCT && !nzac) ? 1 : 8;	/* All rows are identical if no column has AC rows */
+	for (i = 0; i < n; i++) {
+		if (JD_SPARSEIDCT && nzc == 0x01) {	/* Only column 0 is non-zero, every row is flat */
+			v0 = (src[0] + (128L << 8)) >> 8;	/* Remove DC offset (-128) and descale 8 bits */
+#if JD_FASTDECODE >= 1
+			dst[0] = dst[1] = dst[2] = dst[3] = dst[4] = dst[5] = dst[6] = dst[7] = (int16_t)v0;
+#else
+			dst[0] = dst[1] = dst[2] = dst[3] = dst[4] = dst[5] = dst[6] = dst[7] = BYTECLIP(v0);
+#endif
+			dst += 8; src += 8;
+			continue;
+		}
+
 		v0 = src[0] + (128L << 8);	/* Get even elements (remove DC offset (-128) here) */
 		v1 = src[2];
 		v2 = src[4];
@@ -650,22 +722,26 @@ static void block_idct (
 		v1 = t11 + t12;
 		v2 = t12 - t11;
 
-		v4 = src[7];				/* Get odd elements */
-		v5 = src[1];
-		v6 = src[5];
-		v7 = src[3];
-
-		t10 = v5 - v4;				/* Process the odd elements */
-		t11 = v5 + v4;
-		t12 = v6 - v7;
-		v7 += v6;
-		v5 = (t11 - v7) * M13 >> 12;
-		v7 += t11;
-		t13 = (t10 + t12) * M5 >> 12;
-		v4 = t13 - (t10 * M2 >> 12);
-		v6 = t13 - (t12 * M4 >> 12) - v7;
-		v5 -= v6;
-		v4 -= v5;
+		if (JD_SPARSEIDCT && !(nzc & 0xAA)) {	/* No odd elements in any row? */
+			v4 = v5 = v6 = v7 = 0;
+		} else {
+			v4 = src[7];				/* Get odd elements */
+			v5 = src[1];
+			v6 = src[5];
+			v7 = src[3];
+
+			t10 = v5 - v4;				/* Process the odd elements */
+			t11 = v5 + v4;
+			t12 = v6 - v7;
+			v7 += v6;
+			v5 = (t11 - v7) * M13 >> 12;
+			v7 += t11;
+			t13 = (t10 + t12) * M5 >> 12;
+			v4 = t13 - (t10 * M2 >> 12);
+			v6 = t13 - (t12 * M4 >> 12) - v7;
+			v5 -= v6;
+			v4 -= v5;
+		}
 
 		/* Descale the transformed values 8 bits and output a row */
 #if JD_FASTDECODE >= 1
@@ -690,6 +766,233 @@ static void block_idct (
 
 		dst += 8; src += 8;	/* Next row */
 	}
+	for ( ; i < 8; i++) {	/* Replicate the first row if needed */
+		memcpy(dst, dst - 8, 8 * sizeof (jd_yuv_t));
+		dst += 8;
+	}
+}
+
+
+
+
+#if JD_USE_SCALE
+/*-----------------------------------------------------------------------*/
+/* Apply reduced size Inverse-DCT for 1/2 and 1/4 scaled output          */
+/*-----------------------------------------------------------------------*/
+/* With the Arai pre-scaled coefficients G(u), averaging two adjacent
+/  samples of the 8-point IDCT gives exactly
+/    y(m) = G(0) + sum[u=1..3] (G(u) - G(8-u)) * cos((2m+1)u*pi/8)
+/  and averaging four of them gives
+/    y(k) = G(0) +/- (c1 * (G(1) - G(7)) - c3 * (G(3) - G(5))) * c2
+/  so the box-averaged block is produced directly from the low-order
+/  coefficient pairs, without the full butterflies and the averaging pass. */
+
+static void block_idct4 (
+	int32_t* src,	/* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
+	jd_yuv_t* dst	/* Pointer to the destination to store the 4x4 block as byte array */
+)
+{
+	const int32_t C1 = (int32_t)(0.92388*4096), C2 = (int32_t)(0.70711*4096), C3 = (int32_t)(0.38268*4096);
+	int32_t g0, h1, h2, h3, e0, e1, o0, o1;
+	int i;
+
+	/* Process columns (row 4 and column 4 do not contribute to the output) */
+	for (i = 0; i < 8; i++) {
+		if (i == 4) continue;
+		g0 = src[8 * 0 + i];
+		h1 = src[8 * 1 + i] - src[8 * 7 + i];
+		h2 = src[8 * 2 + i] - src[8 * 6 + i];
+		h3 = src[8 * 3 + i] - src[8 * 5 + i];
+
+		e0 = g0 + (h2 * C2 >> 12);		/* Even part */
+		e1 = g0 - (h2 * C2 >> 12);
+		o0 = (h1 * C1 >> 12) + (h3 * C3 >> 12);	/* Odd part */
+		o1 = (h1 * C3 >> 12) - (h3 * C1 >> 12);
+
+		src[8 * 0 + i] = e0 + o0;	/* Write-back transformed values */
+		src[8 * 1 + i] = e1 + o1;
+		src[8 * 2 + i] = e1 - o1;
+		src[8 * 3 + i] = e0 - o0;
+	}
+
+	/* Process rows */
+	for (i = 0; i < 4; i++) {
+		g0 = src[0] + (128L << 8);	/* Remove DC offset (-128) here */
+		h1 = src[1] - src[7];
+		h2 = src[2] - src[6];
+		h3 = src[3] - src[5];
+
+		e0 = g0 + (h2 * C2 >> 12);
+		e1 = g0 - (h2 * C2 >> 12);
+		o0 = (h1 * C1 >> 12) + (h3 * C3 >> 12);
+		o1 = (h1 * C3 >> 12) - (h3 * C1 >> 12);
+
+		/* Descale the transformed values 8 bits and output a row */
+#if JD_FASTDECODE >= 1
+		dst[0] = (int16_t)((e0 + o0) >> 8);
+		dst[1] = (int16_t)((e1 + o1) >> 8);
+		dst[2] = (int16_t)((e1 - o1) >> 8);
+		dst[3] = (int16_t)((e0 - o0) >> 8);
+#else
+		dst[0] = BYTECLIP((e0 + o0) >> 8);
+		dst[1] = BYTECLIP((e1 + o1) >> 8);
+		dst[2] = BYTECLIP((e1 - o1) >> 8);
+		dst[3] = BYTECLIP((e0 - o0) >> 8);
+#endif
+
+		dst += 4; src += 8;	/* Next row */
+	}
+}
+
+
+static void block_idct2 (
+	int32_t* src,	/* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
+	jd_yuv_t* dst	/* Pointer to the destination to store the 2x2 block as byte array */
+)
+{
+	const int32_t K1 = (int32_t)(0.65328*4096), K3 = (int32_t)(0.27060*4096);	/* c1 * c2, c3 * c2 */
+	int32_t g0, o;
+	int i;
+
+	/* Process columns (only rows 0, 1, 3, 5, 7 of columns 0, 1, 3, 5, 7 contribute to the output) */
+	for (i = 0; i < 8; i++) {
+		if (i == 2 || i == 4 || i == 6) continue;
+		g0 = src[8 * 0 + i];
+		o = ((src[8 * 1 + i] - src[8 * 7 + i]) * K1 >> 12) - ((src[8 * 3 + i] - src[8 * 5 + i]) * K3 >> 12);
+		src[8 * 0 + i] = g0 + o;
+		src[8 * 1 + i] = g0 - o;
+	}
+
+	/* Process rows */
+	for (i = 0; i < 2; i++) {
+		g0 = src[0] + (128L << 8);	/* Remove DC offset (-128) here */
+		o = ((src[1] - src[7]) * K1 >> 12) - ((src[3] - src[5]) * K3 >> 12);
+#if JD_FASTDECODE >= 1
+		dst[0] = (int16_t)((g0 + o) >> 8);
+		dst[1] = (int16_t)((g0 - o) >> 8);
+#else
+		dst[0] = BYTECLIP((g0 + o) >> 8);
+		dst[1] = BYTECLIP((g0 - o) >> 8);
+#endif
+		dst += 2; src += 8;	/* Next row */
+	}
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Load a block: huffman decode and de-quantize                          */
+/*-----------------------------------------------------------------------*/
+
+static JRESULT block_load (	/* 0:OK, !0:Error */
+	JDEC* jd,		/* Pointer to the decompressor object */
+	unsigned int cmp,	/* Component number 0:Y, 1:Cb, 2:Cr */
+	int32_t* tmp,	/* 64-element buffer to store the de-quantized coefficients in raster order */
+	uint8_t* nz		/* Non-zero column maps [0]:any element, [1]:rows 1..7 ([0] == 0: DC element only) */
+)
+{
+	int d, e;
+	unsigned int i, bc, z, id;
+	uint8_t nzc, nzac;
+	const int32_t *dqf;
+
+
+	id = cmp ? 1 : 0;						/* Huffman table ID of this component */
+
+	/* Extract a DC element from input stream */
+	d = huffext(jd, id, 0);					/* Extract a huffman coded data (bit length) */
+	if (d < 0) return (JRESULT)(0 - d);		/* Err: invalid code or input */
+	bc = (unsigned int)d;
+	d = jd->dcv[cmp];						/* DC value of previous block */
+	if (bc) {								/* If there is any difference from previous block */
+		e = bitext(jd, bc);					/* Extract data bits */
+		if (e < 0) return (JRESULT)(0 - e);	/* Err: input */
+		bc = 1 << (bc - 1);					/* MSB position */
+		if (!(e & bc)) e -= (bc << 1) - 1;	/* Restore negative value if needed */
+		d += e;								/* Get current value */
+		jd->dcv[cmp] = (int16_t)d;			/* Save current DC value for next block */
+	}
+	dqf = jd->qttbl[jd->qtid[cmp]];			/* De-quantizer table ID for this component */
+	tmp[0] = d * dqf[0] >> 8;				/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+	nzc = 0x01; nzac = 0;					/* Non-zero column maps (the DC element is always counted) */
+
+	/* Extract following 63 AC elements from input stream */
+	memset(&tmp[1], 0, 63 * sizeof (int32_t));	/* Initialize all AC elements */
+	z = 1;		/* Top of the AC elements (in zigzag-order) */
+	do {
+		d = huffext(jd, id, 1);				/* Extract a huffman coded value (zero runs and bit length) */
+		if (d == 0) break;					/* EOB? */
+		if (d < 0) return (JRESULT)(0 - d);	/* Err: invalid code or input error */
+		bc = (unsigned int)d;
+		z += bc >> 4;						/* Skip leading zero run */
+		if (z >= 64) return JDR_FMT1;		/* Too long zero run */
+		if (bc &= 0x0F) {					/* Bit length? */
+			d = bitext(jd, bc);				/* Extract data bits */
+			if (d < 0) return (JRESULT)(0 - d);	/* Err: input device */
+			bc = 1 << (bc - 1);				/* MSB position */
+			if (!(d & bc)) d -= (bc << 1) - 1;	/* Restore negative value if needed */
+			i = Zig[z];						/* Get raster-order index */
+			tmp[i] = d * dqf[i] >> 8;		/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+			nzc |= 1 << (i & 7);			/* Mark the column as non-zero */
+			if (i >= 8) nzac |= 1 << (i & 7);	/* and as having AC rows */
+		}
+	} while (++z < 64);		/* Next AC element */
+
+	nz[0] = (z == 1) ? 0 : nzc;	/* No AC element? */
+	nz[1] = nzac;
+
+	return JDR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Store a block: apply IDCT into the MCU buffer                         */
+/*-----------------------------------------------------------------------*/
+
+static void block_out (
+	JDEC* jd,		/* Pointer to the decompressor object */
+	unsigned int cmp,	/* Component number 0:Y, 1:Cb, 2:Cr */
+	int32_t* tmp,	/* De-quantized coefficients (destroyed) */
+	const uint8_t* nz,	/* Non-zero column maps given by block_load() */
+	jd_yuv_t* bp	/* Block in the MCU buffer */
+)
+{
+	int d;
+	unsigned int i, n, bs, fine;
+
+
+	if (jd->format == JD_FMT_GRAY && cmp) return;	/* C components may not be processed if in grayscale output */
+
+	bs = JD_USE_SCALE ? jd->scale : 0;	/* Descaling ratio of this block */
+	fine = cmp && bs && bs < 3 && jd->msx == 2;	/* Subsampled chroma keeps twice the resolution of luma */
+	bs -= fine;
+	if (!nz[0] || bs == 3) {	/* If no AC element or scale ratio is 1/8, IDCT can be ommited and the block is filled with DC value */
+		d = (jd_yuv_t)((*tmp / 256) + 128);
+		n = 64 >> (bs * 2);		/* Number of pixels in the (descaled) block */
+		if (JD_FASTDECODE >= 1) {
+			for (i = 0; i < n; bp[i++] = d) ;
+		} else {
+			memset(bp, d, n);
+		}
+#if JD_USE_SCALE
+	} else if (bs == 1) {
+		block_idct4(tmp, bp);	/* Apply 4x4 IDCT and store the 1/2 scaled block to the MCU buffer */
+	} else if (bs == 2) {
+		block_idct2(tmp, bp);	/* Apply 2x2 IDCT and store the 1/4 scaled block to the MCU buffer */
+#endif
+	} else {
+		block_idct(tmp, bp, nz[0], nz[1]);	/* Apply IDCT and store the block to the MCU buffer */
+	}
+	if (fine && jd->msy == 1 && nz[0]) {	/* 4:2:2 chroma is not subsampled vertically: average the row pairs into the upper half */
+		n = 8 >> bs;	/* Block width */
+		for (i = 0; i < n * n / 2; i++) {
+			bp[i] = (jd_yuv_t)((bp[i / n * 2 * n + i % n] + bp[i / n * 2 * n + n + i % n] + 1) >> 1);
+		}
+	}
 }
 
 
@@ -700,77 +1003,26 @@ static void block_idct (
 /*-----------------------------------------------------------------------*/
 
 static JRESULT mcu_load (
-	JDEC* jd		/* Pointer to the decompressor object */
+	JDEC* jd,		/* Pointer to the decompressor object */
+	int out			/* 0:Entropy decoding only (the MCU is not output) */
 )
 {
 	int32_t *tmp = (int32_t*)jd->workbuf;	/* Block working buffer for de-quantize and IDCT */
-	int d, e;
-	unsigned int blk, nby, i, bc, z, id, cmp;
+	unsigned int blk, nby, cmp;
+	uint8_t nz[2];
 	jd_yuv_t *bp;
-	const int32_t *dqf;
+	JRESULT rc;
 
 
 	nby = jd->msx * jd->msy;	/* Number of Y blocks (1, 2 or 4) */
 	bp = jd->mcubuf;			/* Pointer to the first block of MCU */
 
-	for (blk = 0; blk < nby + 2; blk++) {	/* Get nby Y blocks and two C blocks */
+	for (blk = 0; blk < nby + (jd->ncomp == 3 ? 2 : 0); blk++) {	/* Get nby Y blocks and two C blocks (none in grayscale image) */
 		cmp = (blk < nby) ? 0 : blk - nby + 1;	/* Component number 0:Y, 1:Cb, 2:Cr */
 
-		if (cmp && jd->ncomp != 3) {		/* Clear C blocks if not exist (monochrome image) */
-			for (i = 0; i < 64; bp[i++] = 128) ;
-
-		} else {							/* Load Y/C blocks from input stream */
-			id = cmp ? 1 : 0;						/* Huffman table ID of this component */
-
-			/* Extract a DC element from input stream */
-			d = huffext(jd, id, 0);					/* Extract a huffman coded data (bit length) */
-			if (d < 0) return (JRESULT)(0 - d);		/* Err: invalid code or input */
-			bc = (unsigned int)d;
-			d = jd->dcv[cmp];						/* DC value of previous block */
-			if (bc) {								/* If there is any difference from previous block */
-				e = bitext(jd, bc);					/* Extract data bits */
-				if (e < 0) return (JRESULT)(0 - e);	/* Err: input */
-				bc = 1 << (bc - 1);					/* MSB position */
-				if (!(e & bc)) e -= (bc << 1) - 1;	/* Restore negative value if needed */
-				d += e;								/* Get current value */
-				jd->dcv[cmp] = (int16_t)d;			/* Save current DC value for next block */
-			}
-			dqf = jd->qttbl[jd->qtid[cmp]];			/* De-quantizer table ID for this component */
-			tmp[0] = d * dqf[0] >> 8;				/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
-
-			/* Extract following 63 AC elements from input stream */
-			memset(&tmp[1], 0, 63 * sizeof (int32_t));	/* Initialize all AC elements */
-			z = 1;		/* Top of the AC elements (in zigzag-order) */
-			do {
-				d = huffext(jd, id, 1);				/* Extract a huffman coded value (zero runs and bit length) */
-				if (d == 0) break;					/* EOB? */
-				if (d < 0) return (JRESULT)(0 - d);	/* Err: invalid code or input error */
-				bc = (unsigned int)d;
-				z += bc >> 4;						/* Skip leading zero run */
-				if (z >= 64) return JDR_FMT1;		/* Too long zero run */
-				if (bc &= 0x0F) {					/* Bit length? */
-					d = bitext(jd, bc);				/* Extract data bits */
-					if (d < 0) return (JRESULT)(0 - d);	/* Err: input device */
-					bc = 1 << (bc - 1);				/* MSB position */
-					if (!(d & bc)) d -= (bc << 1) - 1;	/* Restore negative value if needed */
-					i = Zig[z];						/* Get raster-order index */
-					tmp[i] = d * dqf[i] >> 8;		/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
-				}
-			} while (++z < 64);		/* Next AC element */
-
-			if (JD_FORMAT != 2 || !cmp) {	/* C components may not be processed if in grayscale output */
-				if (z == 1 || (JD_USE_SCALE && jd->scale == 3)) {	/* If no AC element or scale ratio is 1/8, IDCT can be ommited and the block is filled with DC value */
-					d = (jd_yuv_t)((*tmp / 256) + 128);
-					if (JD_FASTDECODE >= 1) {
-						for (i = 0; i < 64; bp[i++] = d) ;
-					} else {
-						memset(bp, d, 64);
-					}
-				} else {
-					block_idct(tmp, bp);	/* Apply IDCT and store the block to the MCU buffer */
-				}
-			}
-		}
+		rc = block_load(jd, cmp, tmp, nz);		/* Load Y/C blocks from input stream */
+		if (rc != JDR_OK) return rc;
+		if (out) block_out(jd, cmp, tmp, nz, bp);	/* IDCT (or fill) into the MCU buffer */
 
 		bp += 64;				/* Next block */
 	}
@@ -781,22 +1033,170 @@ static JRESULT mcu_load (
 
 
 
+#if JD_FASTRGB565
+/*-----------------------------------------------------------------------*/
+/* Store an output pixel in the format of the session                    */
+/*-----------------------------------------------------------------------*/
+
+static void put_pixel (
+	uint8_t* op,		/* Where the pixel goes */
+	unsigned int fmt,	/* Output pixel format (JD_FMT_*, except JD_FMT_GRAY) */
+	uint8_t swap,		/* Byte order reversed */
+	unsigned int r,		/* Clipped R, G and B values */
+	unsigned int g,
+	unsigned int b
+)
+{
+	uint32_t w;
+
+
+	switch (fmt) {
+	case JD_FMT_RGB565:
+		w = (r & 0xF8) << 8 | (g & 0xFC) << 3 | b >> 3;
+		*(uint16_t*)op = swap ? (uint16_t)(w << 8 | w >> 8) : (uint16_t)w;
+		break;
+	case JD_FMT_RGB888:
+		op[0] = (uint8_t)(swap ? b : r); op[1] = (uint8_t)g; op[2] = (uint8_t)(swap ? r : b);
+		break;
+	default:	/* JD_FMT_ARGB8888 */
+		*(uint32_t*)op = swap ? b << 24 | g << 16 | r << 8 | 0xFF : 0xFF000000 | r << 16 | g << 8 | b;
+	}
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Convert the Y/Cb/Cr blocks of an MCU straight into output pixels      */
+/*-----------------------------------------------------------------------*/
+/* The inner loop is spelled once per format so that each one is compiled
+/  with its store inlined and no branch on the format per pixel. */
+
+#define MCU_COLOR_LOOP(fmt)	\
+	for (iy = oy; iy < ry; iy++, dst += dy) {	\
+		op = dst;	\
+		py = jd->mcubuf + (iy / bs) * jd->msx * 64 + (iy % bs) * bs;	/* Blocks are stored as bs x bs pixels */	\
+		py += (ox > bs) ? ox - bs + 64 : ox;	\
+		pc = jd->mcubuf + nby * 64 + (iy >> cvs) * cbs + (ox >> hm);	\
+		for (ix = ox; ix < rx; ) {	\
+			if (JD_FASTDECODE >= 1) {	/* Filled blocks are not clipped, ringing goes out of the tables */	\
+				CHROMA(BYTECLIP(*pc) - 128, BYTECLIP(pc[64]) - 128);	\
+			} else {	\
+				CHROMA(*pc - 128, pc[64] - 128);	/* Chroma contributions, computed once per chroma sample */	\
+			}	\
+			pc++;	\
+			do {	\
+				if (ix == bs) py += 64 - bs;	/* Jump to next Y block if double block width */	\
+				yy = *py++;	\
+				put_pixel(op, fmt, swap, BYTECLIP(yy + dr), BYTECLIP(yy - dg), BYTECLIP(yy + db));	\
+				op += dx;	\
+			} while (++ix < rx && (ix & hm));	\
+		}	\
+	}
+
+#if JD_TBLCOLOR
+#define CHROMA(cb, cr)	{ dr = CrR[(cr) + 128]; dg = (CbG[(cb) + 128] + CrG[(cr) + 128]) / 1024; db = CbB[(cb) + 128]; }
+#else
+#define CHROMA(cb, cr)	{ dr = ((int)(1.402 * CVACC) * (cr)) / CVACC; dg = ((int)(0.344 * CVACC) * (cb) + (int)(0.714 * CVACC) * (cr)) / CVACC; db = ((int)(1.772 * CVACC) * (cb)) / CVACC; }
+#endif
+
+static void mcu_color (
+	JDEC* jd,			/* Pointer to the decompressor object */
+	uint8_t* dst,		/* Top-left pixel of the output rectangular */
+	int32_t dx,			/* Distance between horizontally adjacent output pixels (bytes) */
+	int32_t dy,			/* Distance between vertically adjacent output pixels (bytes) */
+	unsigned int ox,	/* Location of the output rectangular in the descaled MCU */
+	unsigned int oy,
+	unsigned int rx,	/* Number of effective pixels in horizontal (clipped and descaled) */
+	unsigned int ry		/* Number of effective pixels in vertical (clipped and descaled) */
+)
+{
+#if !JD_TBLCOLOR
+	const int CVACC = (sizeof (int) > 2) ? 1024 : 128;
+#endif
+	const unsigned int bs = JD_USE_SCALE ? 8 >> jd->scale : 8;	/* Y block size (pixel) */
+	const unsigned int cup = (bs == 4 || bs == 2) && jd->msx == 2;	/* Chroma blocks were descaled one step less? */
+	const unsigned int cbs = bs << cup;		/* C block width (pixel) */
+	const unsigned int cvs = (jd->msy == 2 && !cup) ? 1 : 0;	/* Log2 of the rows sharing a chroma row */
+	const unsigned int hm = cup ? 0 : jd->msx - 1;	/* Pixels sharing a chroma sample - 1 (0 or 1) */
+	const uint8_t swap = jd->swap;
+	unsigned int ix, iy, nby = jd->msx * jd->msy;
+	int yy, dr, dg, db;
+	const jd_yuv_t *py, *pc;
+	uint8_t *op;
+
+
+	rx += ox; ry += oy;
+	switch (jd->format) {
+	case JD_FMT_RGB565:		MCU_COLOR_LOOP(JD_FMT_RGB565); break;
+	case JD_FMT_RGB888:		MCU_COLOR_LOOP(JD_FMT_RGB888); break;
+	default:				MCU_COLOR_LOOP(JD_FMT_ARGB8888);
+	}
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Expand the Y blocks of an MCU straight into gray output pixels        */
+/*-----------------------------------------------------------------------*/
+/* For a grayscale picture (there are no C blocks) in any format, and for
+/  the grayscale output of a color picture. */
+
+#define MCU_LUMA_LOOP(fmt)	\
+	for (iy = oy; iy < ry; iy++, dst += dy) {	\
+		op = dst;	\
+		py = jd->mcubuf + (iy / bs) * jd->msx * 64 + (iy % bs) * bs;	/* Blocks are stored as bs x bs pixels */	\
+		py += (ox > bs) ? ox - bs + 64 : ox;	\
+		for (ix = ox; ix < rx; ix++) {	\
+			if (ix == bs) py += 64 - bs;		/* Jump to next Y block if double block width */	\
+			yy = (JD_FASTDECODE >= 1) ? BYTECLIP(*py++) : *py++;	/* Filled blocks are not clipped */	\
+			if (fmt == JD_FMT_GRAY) *op = (uint8_t)yy; else put_pixel(op, fmt, swap, yy, yy, yy);	\
+			op += dx;	\
+		}	\
+	}
+
+static void mcu_luma (
+	JDEC* jd,			/* Pointer to the decompressor object */
+	uint8_t* dst,		/* Top-left pixel of the output rectangular */
+	int32_t dx,			/* Distance between horizontally adjacent output pixels (bytes) */
+	int32_t dy,			/* Distance between vertically adjacent output pixels (bytes) */
+	unsigned int ox,	/* Location of the output rectangular in the descaled MCU */
+	unsigned int oy,
+	unsigned int rx,	/* Number of effective pixels in horizontal (clipped and descaled) */
+	unsigned int ry		/* Number of effective pixels in vertical (clipped and descaled) */
+)
+{
+	const unsigned int bs = JD_USE_SCALE ? 8 >> jd->scale : 8;	/* Y block size (pixel) */
+	const uint8_t swap = jd->swap;
+	unsigned int ix, iy, yy;
+	const jd_yuv_t *py;
+	uint8_t *op;
+
+
+	rx += ox; ry += oy;
+	switch (jd->format) {
+	case JD_FMT_RGB565:		MCU_LUMA_LOOP(JD_FMT_RGB565); break;
+	case JD_FMT_GRAY:		MCU_LUMA_LOOP(JD_FMT_GRAY); break;
+	case JD_FMT_RGB888:		MCU_LUMA_LOOP(JD_FMT_RGB888); break;
+	default:				MCU_LUMA_LOOP(JD_FMT_ARGB8888);
+	}
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Output an MCU: Convert YCrCb to RGB and output it in RGB form         */
 /*-----------------------------------------------------------------------*/
 
 static JRESULT mcu_output (
 	JDEC* jd,			/* Pointer to the decompressor object */
-	int (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function */
+	int (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function (optional if jd->dstbuf is set) */
 	unsigned int x,		/* MCU location in the image */
 	unsigned int y		/* MCU location in the image */
 )
 {
-	const int CVACC = (sizeof (int) > 2) ? 1024 : 128;	/* Adaptive accuracy for both 16-/32-bit systems */
-	unsigned int ix, iy, mx, my, rx, ry;
-	int yy, cb, cr;
-	jd_yuv_t *py, *pc;
-	uint8_t *pix;
+	unsigned int mx, my, rx, ry, ox, oy;
+	uint8_t *op;
+	int32_t dx, dy;
 	JRECT rect;
 
 
@@ -807,49 +1207,87 @@ static JRESULT mcu_output (
 		rx >>= jd->scale; ry >>= jd->scale;
 		if (!rx || !ry) return JDR_OK;					/* Skip this MCU if all pixel is to be rounded off */
 		x >>= jd->scale; y >>= jd->scale;
+		mx >>= jd->scale; my >>= jd->scale;				/* Descaled MCU size (the blocks were descaled by IDCT) */
+	}
+	ox = (x < jd->crop.left) ? jd->crop.left - x : 0;	/* Clip the rectangular to the output window */
+	oy = (y < jd->crop.top) ? jd->crop.top - y : 0;
+	if (x + rx > jd->crop.right + 1u) rx = (x > jd->crop.right) ? 0 : jd->crop.right + 1u - x;
+	if (y + ry > jd->crop.bottom + 1u) ry = (y > jd->crop.bottom) ? 0 : jd->crop.bottom + 1u - y;
+	if (rx <= ox || ry <= oy) return JDR_OK;			/* Skip this MCU if it is out of the window */
+	rx -= ox; ry -= oy;
+	rect.left = x + ox; rect.right = rect.left + rx - 1;	/* Rectangular area in the image */
+	rect.top = y + oy; rect.bottom = rect.top + ry - 1;
+
+	if (jd->dstbuf) {	/* Output pixels are placed in the frame buffer, the window at its top-left */
+		dx = jd->dstdx; dy = jd->dstdy;
+		op = jd->dstbuf + (int32_t)(rect.left - jd->crop.left) * dx + (int32_t)(rect.top - jd->crop.top) * dy;
+	} else {			/* Output rows are packed in the working buffer */
+		op = (uint8_t*)jd->workbuf;
+		dx = JD_BPP(jd->format); dy = rx * dx;
 	}
-	rect.left = x; rect.right = x + rx - 1;				/* Rectangular area in the frame buffer */
-	rect.top = y; rect.bottom = y + ry - 1;
-
 
-	if (!JD_USE_SCALE || jd->scale != 3) {	/* Not for 1/8 scaling */
-		pix = (uint8_t*)jd->workbuf;
+#if JD_FASTRGB565
+	if (jd->ncomp == 3 && jd->format != JD_FMT_GRAY) {
+		mcu_color(jd, op, dx, dy, ox, oy, rx, ry);	/* Single pass conversion */
+	} else {
+		mcu_luma(jd, op, dx, dy, ox, oy, rx, ry);	/* Grayscale image or output: Y only */
+	}
+	(void)mx; (void)my;
 
-		if (JD_FORMAT != 2) {	/* RGB output (build an RGB MCU from Y/C component) */
+#else
+	{
+#if !JD_TBLCOLOR
+		const int CVACC = (sizeof (int) > 2) ? 1024 : 128;	/* Adaptive accuracy for both 16-/32-bit systems */
+#endif
+		const unsigned int bs = JD_USE_SCALE ? 8 >> jd->scale : 8;	/* Y block size (pixel) */
+		const unsigned int cup = (bs == 4 || bs == 2) && jd->msx == 2;	/* Chroma blocks were descaled one step less? */
+		const unsigned int cvs = (jd->msy == 2 && !cup) ? 1 : 0;	/* Log2 of the rows sharing a chroma row */
+		const unsigned int ps = (jd->format == JD_FMT_ARGB8888) ? 4 : 3;	/* RGB MCU pixel size (ARGB8888 is converted in place) */
+		unsigned int ix, iy, nby = jd->msx * jd->msy;
+		int yy, cb, cr;
+		jd_yuv_t *py, *pc;
+		uint8_t *pix = (uint8_t*)jd->workbuf;
+
+		if (jd->format != JD_FMT_GRAY && jd->ncomp != 3) {	/* RGB output of a grayscale image (no C blocks, R = G = B = Y) */
 			for (iy = 0; iy < my; iy++) {
-				pc = py = jd->mcubuf;
-				if (my == 16) {		/* Double block height? */
-					pc += 64 * 4 + (iy >> 1) * 8;
-					if (iy >= 8) py += 64;
-				} else {			/* Single block height */
-					pc += mx * 8 + iy * 8;
+				py = jd->mcubuf + (iy / bs) * jd->msx * 64 + (iy % bs) * bs;
+				for (ix = 0; ix < mx; ix++) {
+					if (jd->msx == 2 && ix == bs) py += 64 - bs;	/* Jump to next block if double block width */
+					yy = (JD_FASTDECODE >= 1) ? BYTECLIP(*py++) : *py++;
+					pix[0] = pix[1] = pix[2] = (uint8_t)yy; pix += ps;
 				}
-				py += iy * 8;
+			}
+		} else if (jd->format != JD_FMT_GRAY) {	/* RGB output (build an RGB MCU from Y/C component) */
+			for (iy = 0; iy < my; iy++) {
+				py = jd->mcubuf + (iy / bs) * jd->msx * 64 + (iy % bs) * bs;
+				pc = jd->mcubuf + nby * 64 + (iy >> cvs) * (bs << cup);
 				for (ix = 0; ix < mx; ix++) {
-					cb = pc[0] - 128; 	/* Get Cb/Cr component and remove offset */
-					cr = pc[64] - 128;
-					if (mx == 16) {					/* Double block width? */
-						if (ix == 8) py += 64 - 8;	/* Jump to next block if double block heigt */
-						pc += ix & 1;				/* Step forward chroma pointer every two pixels */
+					cb = ((JD_FASTDECODE >= 1) ? BYTECLIP(pc[0]) : pc[0]) - 128; 	/* Get Cb/Cr component and remove offset */
+					cr = ((JD_FASTDECODE >= 1) ? BYTECLIP(pc[64]) : pc[64]) - 128;
+					if (jd->msx == 2) {				/* Double block width? */
+						if (ix == bs) py += 64 - bs;	/* Jump to next block if double block width */
+						pc += cup | (ix & 1);		/* Step forward chroma pointer every two pixels (or every pixel if chroma was not descaled) */
 					} else {						/* Single block width */
 						pc++;						/* Step forward chroma pointer every pixel */
 					}
 					yy = *py++;			/* Get Y component */
-					*pix++ = /*R*/ BYTECLIP(yy + ((int)(1.402 * CVACC) * cr) / CVACC);
-					*pix++ = /*G*/ BYTECLIP(yy - ((int)(0.344 * CVACC) * cb + (int)(0.714 * CVACC) * cr) / CVACC);
-					*pix++ = /*B*/ BYTECLIP(yy + ((int)(1.772 * CVACC) * cb) / CVACC);
+#if JD_TBLCOLOR
+					pix[0] = /*R*/ BYTECLIP(yy + CrR[cr + 128]);
+					pix[1] = /*G*/ BYTECLIP(yy - (CbG[cb + 128] + CrG[cr + 128]) / 1024);
+					pix[2] = /*B*/ BYTECLIP(yy + CbB[cb + 128]);
+#else
+					pix[0] = /*R*/ BYTECLIP(yy + ((int)(1.402 * CVACC) * cr) / CVACC);
+					pix[1] = /*G*/ BYTECLIP(yy - ((int)(0.344 * CVACC) * cb + (int)(0.714 * CVACC) * cr) / CVACC);
+					pix[2] = /*B*/ BYTECLIP(yy + ((int)(1.772 * CVACC) * cb) / CVACC);
+#endif
+					pix += ps;
 				}
 			}
 		} else {	/* Monochrome output (build a grayscale MCU from Y comopnent) */
 			for (iy = 0; iy < my; iy++) {
-				py = jd->mcubuf + iy * 8;
-				if (my == 16) {		/* Double block height? */
-					if (iy >= 8) py += 64;
-				}
+				py = jd->mcubuf + (iy / bs) * jd->msx * 64 + (iy % bs) * bs;
 				for (ix = 0; ix < mx; ix++) {
-					if (mx == 16) {					/* Double block width? */
-						if (ix == 8) py += 64 - 8;	/* Jump to next block if double block height */
-					}
+					if (jd->msx == 2 && ix == bs) py += 64 - bs;	/* Jump to next block if double block width */
 					if (JD_FASTDECODE >= 1) {
 						*pix++ = BYTECLIP(*py++);	/* Get and store a Y value as grayscale */
 					} else {
@@ -858,111 +1296,57 @@ static JRESULT mcu_output (
 				}
 			}
 		}
-
-		/* Descale the MCU rectangular if needed */
-		if (JD_USE_SCALE && jd->scale) {
-			unsigned int x, y, r, g, b, s, w, a;
-			uint8_t *op;
-
-			/* Get averaged RGB value of each square correcponds to a pixel */
-			s = jd->scale * 2;	/* Number of shifts for averaging */
-			w = 1 << jd->scale;	/* Width of square */
-			a = (mx - w) * (JD_FORMAT != 2 ? 3 : 1);	/* Bytes to skip for next line in the square */
-			op = (uint8_t*)jd->workbuf;
-			for (iy = 0; iy < my; iy += w) {
-				for (ix = 0; ix < mx; ix += w) {
-					pix = (uint8_t*)jd->workbuf + (iy * mx + ix) * (JD_FORMAT != 2 ? 3 : 1);
-					r = g = b = 0;
-					for (y = 0; y < w; y++) {	/* Accumulate RGB value in the square */
-						for (x = 0; x < w; x++) {
-							r += *pix++;	/* Accumulate R or Y (monochrome output) */
-							if (JD_FORMAT != 2) {	/* RGB output? */
-								g += *pix++;	/* Accumulate G */
-								b += *pix++;	/* Accumulate B */
-							}
-						}
-						pix += a;
-					}							/* Put the averaged pixel value */
-					*op++ = (uint8_t)(r >> s);	/* Put R or Y (monochrome output) */
-					if (JD_FORMAT != 2) {	/* RGB output? */
-						*op++ = (uint8_t)(g >> s);	/* Put G */
-						*op++ = (uint8_t)(b >> s);	/* Put B */
-					}
-				}
-			}
-		}
-
-	} else {	/* For only 1/8 scaling (left-top pixel in each block are the DC value of the block) */
-
-		/* Build a 1/8 descaled RGB MCU from discrete comopnents */
-		pix = (uint8_t*)jd->workbuf;
-		pc = jd->mcubuf + mx * my;
-		cb = pc[0] - 128;		/* Get Cb/Cr component and restore right level */
-		cr = pc[64] - 128;
-		for (iy = 0; iy < my; iy += 8) {
-			py = jd->mcubuf;
-			if (iy == 8) py += 64 * 2;
-			for (ix = 0; ix < mx; ix += 8) {
-				yy = *py;	/* Get Y component */
-				py += 64;
-				if (JD_FORMAT != 2) {
-					*pix++ = /*R*/ BYTECLIP(yy + ((int)(1.402 * CVACC) * cr / CVACC));
-					*pix++ = /*G*/ BYTECLIP(yy - ((int)(0.344 * CVACC) * cb + (int)(0.714 * CVACC) * cr) / CVACC);
-					*pix++ = /*B*/ BYTECLIP(yy + ((int)(1.772 * CVACC) * cb / CVACC));
-				} else {
-					*pix++ = yy;
-				}
-			}
-		}
 	}
 
-	/* Squeeze up pixel table if a part of MCU is to be truncated */
-	mx >>= jd->scale;
-	if (rx < mx) {	/* Is the MCU spans rigit edge? */
-		uint8_t *s, *d;
+	/* Squeeze up pixel table into the output (working buffer or frame buffer) */
+	{
+		const unsigned int ps = (jd->format == JD_FMT_GRAY) ? 1 : (jd->format == JD_FMT_ARGB8888) ? 4 : 3;	/* Pixel size in the MCU */
+		const unsigned int bpp = JD_BPP(jd->format);
+		uint8_t *s = (uint8_t*)jd->workbuf + (oy * mx + ox) * ps, *d;
 		unsigned int x, y;
 
-		s = d = (uint8_t*)jd->workbuf;
 		for (y = 0; y < ry; y++) {
-			for (x = 0; x < rx; x++) {	/* Copy effective pixels */
-				*d++ = *s++;
-				if (JD_FORMAT != 2) {
-					*d++ = *s++;
-					*d++ = *s++;
+			d = op + (int32_t)y * dy;
+			if (jd->format == JD_FMT_RGB565) {	/* Convert RGB888 to RGB565 */
+				uint16_t w;
+
+				for (x = 0; x < rx; x++) {
+					w =  (*s++ & 0xF8) << 8;    // RRRRR-----------
+					w |= (*s++ & 0xFC) << 3;    // -----GGGGGG-----
+					w |= *s++ >> 3;             // -----------BBBBB
+					if (jd->swap) w = (w << 8) | (w >> 8);	// Swap bytes
+					*(uint16_t*)d = w; d += dx;
+				}
+			} else if (jd->format == JD_FMT_ARGB8888) {	/* Convert RGB888 to ARGB8888 in place */
+				uint32_t w;
+
+				for (x = 0; x < rx; x++, s += 4) {
+					w = jd->swap ? (uint32_t)s[2] << 24 | (uint32_t)s[1] << 16 | (uint32_t)s[0] << 8 | 0xFF
+						: 0xFF000000 | (uint32_t)s[0] << 16 | (uint32_t)s[1] << 8 | s[2];
+					*(uint32_t*)d = w; d += dx;
+				}
+			} else if (jd->format == JD_FMT_RGB888 && jd->swap) {	/* Reverse the byte order (B, G, R) */
+				uint8_t r;
+
+				for (x = 0; x < rx; x++, s += 3) {
+					r = s[0]; d[0] = s[2]; d[1] = s[1]; d[2] = r; d += dx;
+				}
+			} else if (dx == (int32_t)bpp) {	/* Copy effective pixels */
+				if (d != s) memmove(d, s, rx * bpp);
+				s += rx * bpp;
+			} else {				/* Copy effective pixels one at a time into the turned frame buffer */
+				for (x = 0; x < rx; x++) {
+					memcpy(d, s, bpp); d += dx; s += bpp;
 				}
 			}
-			s += (mx - rx) * (JD_FORMAT != 2 ? 3 : 1);	/* Skip truncated pixels */
+			s += (mx - rx) * ps;		/* Skip truncated pixels */
 		}
 	}
-
-	/* Convert RGB888 to RGB565 if needed */
-	if (JD_FORMAT == 1) {
-		uint8_t *s = (uint8_t*)jd->workbuf;
-		uint16_t w, *d = (uint16_t*)s;
-		unsigned int n = rx * ry;
-
-    if (jd->swap)
-    {
-      do {
-        w =  (*s++ & 0xF8) << 8;    // RRRRR-----------
-        w |= (*s++ & 0xFC) << 3;    // -----GGGGGG-----
-        w |= *s++ >> 3;             // -----------BBBBB
-        *d++ = (w << 8) | (w >> 8); // Swap bytes
-      }   while (--n);
-    }
-    else
-    {
-      do {
-        w = ( *s++ & 0xF8) << 8;  // RRRRR-----------
-        w |= (*s++ & 0xFC) << 3;  // -----GGGGGG-----
-        w |= *s++ >> 3;           // -----------BBBBB
-        *d++ = w;
-      }   while (--n);
-    }
-	}
+#endif
 
 	/* Output the rectangular */
-	return outfunc(jd, jd->workbuf, &rect) ? JDR_OK : JDR_INTR; 
+	if (!outfunc) return JDR_OK;
+	return outfunc(jd, op, &rect) ? JDR_OK : JDR_INTR;
 }
 
 
@@ -990,14 +1374,23 @@ JRESULT jd_prepare (
 	JRESULT rc;
 
   uint8_t tmp = jd->swap; // Copy the swap flag
+	uint8_t nolut = jd->nolut;	/* Keep the huffman table switch as well */
+	size_t szbuf = jd->szbuf;	/* and the input buffer size */
+	uint8_t format = jd->format;	/* the output pixel format */
+	uint8_t orient = jd->orient;	/* and the output orientation */
 	memset(jd, 0, sizeof (JDEC));	/* Clear decompression object (this might be a problem if machine's null pointer is not all bits zero) */
 	jd->pool = pool;		/* Work memroy */
 	jd->sz_pool = sz_pool;	/* Size of given work memory */
 	jd->infunc = infunc;	/* Stream input function */
 	jd->device = dev;		/* I/O device identifier */
   jd->swap = tmp; // Restore the swap flag
+	jd->nolut = nolut;
+	jd->szbuf = szbuf ? szbuf : JD_SZBUF;
+	jd->format = format ? format : JD_FORMAT + 1;
+	if (jd->format > JD_FMT_ARGB8888) return JDR_PAR;
+	jd->orient = orient;
 
-	jd->inbuf = seg = alloc_pool(jd, JD_SZBUF);		/* Allocate stream input buffer */
+	jd->inbuf = seg = alloc_pool(jd, jd->szbuf);	/* Allocate stream input buffer */
 	if (!seg) return JDR_MEM1;
 
 	ofs = marker = 0;		/* Find SOI marker */
@@ -1018,7 +1411,7 @@ JRESULT jd_prepare (
 
 		switch (marker & 0xFF) {
 		case 0xC0:	/* SOF0 (baseline JPEG) */
-			if (len > JD_SZBUF) return JDR_MEM2;
+			if (len > jd->szbuf) return JDR_MEM2;
 			if (jd->infunc(jd, seg, len) != len) return JDR_INP;	/* Load segment data */
 
 			jd->width = LDB_WORD(&seg[3]);		/* Image width in unit of pixel */
@@ -1043,14 +1436,14 @@ JRESULT jd_prepare (
 			break;
 
 		case 0xDD:	/* DRI - Define Restart Interval */
-			if (len > JD_SZBUF) return JDR_MEM2;
+			if (len > jd->szbuf) return JDR_MEM2;
 			if (jd->infunc(jd, seg, len) != len) return JDR_INP;	/* Load segment data */
 
 			jd->nrst = LDB_WORD(seg);	/* Get restart interval (MCUs) */
 			break;
 
 		case 0xC4:	/* DHT - Define Huffman Tables */
-			if (len > JD_SZBUF) return JDR_MEM2;
+			if (len > jd->szbuf) return JDR_MEM2;
 			if (jd->infunc(jd, seg, len) != len) return JDR_INP;	/* Load segment data */
 
 			rc = create_huffman_tbl(jd, seg, len);	/* Create huffman tables */
@@ -1058,7 +1451,7 @@ JRESULT jd_prepare (
 			break;
 
 		case 0xDB:	/* DQT - Define Quaitizer Tables */
-			if (len > JD_SZBUF) return JDR_MEM2;
+			if (len > jd->szbuf) return JDR_MEM2;
 			if (jd->infunc(jd, seg, len) != len) return JDR_INP;	/* Load segment data */
 
 			rc = create_qt_tbl(jd, seg, len);	/* Create de-quantizer tables */
@@ -1066,7 +1459,7 @@ JRESULT jd_prepare (
 			break;
 
 		case 0xDA:	/* SOS - Start of Scan */
-			if (len > JD_SZBUF) return JDR_MEM2;
+			if (len > jd->szbuf) return JDR_MEM2;
 			if (jd->infunc(jd, seg, len) != len) return JDR_INP;	/* Load segment data */
 
 			if (!jd->width || !jd->height) return JDR_FMT1;	/* Err: Invalid image size */
@@ -1088,16 +1481,17 @@ JRESULT jd_prepare (
 			/* Allocate working buffer for MCU and pixel output */
 			n = jd->msy * jd->msx;						/* Number of Y blocks in the MCU */
 			if (!n) return JDR_FMT1;					/* Err: SOF0 has not been loaded */
-			len = n * 64 * 2 + 64;						/* Allocate buffer for IDCT and RGB output */
+			i = JD_BPP(jd->format);
+			len = n * 64 * (i > 2 ? i : 2) + 64;		/* Allocate buffer for IDCT and RGB output */
 			if (len < 256) len = 256;					/* but at least 256 byte is required for IDCT */
 			jd->workbuf = alloc_pool(jd, len);			/* and it may occupy a part of following MCU working buffer for RGB output */
 			if (!jd->workbuf) return JDR_MEM1;			/* Err: not enough memory */
 			jd->mcubuf = alloc_pool(jd, (n + 2) * 64 * sizeof (jd_yuv_t));	/* Allocate MCU working buffer */
 			if (!jd->mcubuf) return JDR_MEM1;			/* Err: not enough memory */
 
-			/* Align stream read offset to JD_SZBUF */
-			if (ofs %= JD_SZBUF) {
-				jd->dctr = jd->infunc(jd, seg + ofs, (size_t)(JD_SZBUF - ofs));
+			/* Align stream read offset to the buffer size */
+			if (ofs %= jd->szbuf) {
+				jd->dctr = jd->infunc(jd, seg + ofs, (size_t)(jd->szbuf - ofs));
 			}
 			jd->dptr = seg + ofs - (JD_FASTDECODE ? 0 : 1);
 
@@ -1129,42 +1523,384 @@ JRESULT jd_prepare (
 
 
 /*-----------------------------------------------------------------------*/
-/* Start to decompress the JPEG picture                                  */
+/* Number of MCUs in the image                                           */
 /*-----------------------------------------------------------------------*/
 
-JRESULT jd_decomp (
+static uint32_t mcu_count (
+	JDEC* jd		/* Pointer to the decompressor object */
+)
+{
+	unsigned int mx = jd->msx * 8, my = jd->msy * 8;
+
+	return (uint32_t)((jd->width + mx - 1) / mx) * ((jd->height + my - 1) / my);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Number of MCUs up to the last MCU row in the output window            */
+/*-----------------------------------------------------------------------*/
+
+static uint32_t mcu_end (
+	JDEC* jd		/* Pointer to the decompressor object started by jd_decomp_start_crop() */
+)
+{
+	unsigned int mx = jd->msx * 8, my = jd->msy * 8;
+	uint32_t nx = (jd->width + mx - 1) / mx, n;
+
+
+	n = ((uint32_t)jd->crop.bottom << (JD_USE_SCALE ? jd->scale : 0)) / my + 1;	/* MCU rows up to the bottom of the window */
+	return (n < (jd->height + my - 1) / my) ? n * nx : mcu_count(jd);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Check if an MCU has pixels in the output window                       */
+/*-----------------------------------------------------------------------*/
+
+static int mcu_visible (	/* 1:The MCU is to be output, 0:It is only entropy decoded */
+	JDEC* jd,		/* Pointer to the decompressor object started by jd_decomp_start_crop() */
+	unsigned int x,	/* MCU location in the image */
+	unsigned int y
+)
+{
+	unsigned int s = JD_USE_SCALE ? jd->scale : 0;
+
+
+	return (x >> s) <= jd->crop.right && (x + jd->msx * 8) >> s > jd->crop.left
+		&& (y >> s) <= jd->crop.bottom && (y + jd->msy * 8) >> s > jd->crop.top;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Set up the output window and its placement in the frame buffer        */
+/*-----------------------------------------------------------------------*/
+/* The window is placed at the top-left of the frame buffer, turned as
+/  given by jd->orient (EXIF orientation: 2:mirrored, 3:180 deg, 4:flipped,
+/  5:transposed, 6:90 deg CW, 7:transversed, 8:270 deg CW), so that each
+/  pixel is stored at dstbuf + x * dstdx + y * dstdy. */
+
+static JRESULT set_output (
+	JDEC* jd,		/* Pointer to the decompressor object */
+	uint8_t* dst,	/* Frame buffer (0:output function only) */
+	size_t stride,	/* Distance between rows in the frame buffer (bytes) */
+	uint8_t scale,	/* Output de-scaling factor (0 to 3) */
+	const JRECT* crop	/* Output window in descaled pixels (0:whole picture) */
+)
+{
+	unsigned int w, h;
+	int32_t b = JD_BPP(jd->format), r = (int32_t)stride, ofs;
+
+
+	if (scale > (JD_USE_SCALE ? 3 : 0)) return JDR_PAR;
+	if (jd->orient > 8) return JDR_PAR;
+	if (!crop) {
+		w = jd->width >> scale; h = jd->height >> scale;
+		jd->crop.left = jd->crop.top = 0;
+		jd->crop.right = (uint16_t)(w - 1);
+		jd->crop.bottom = (uint16_t)(h - 1);
+	} else {
+		if (crop->left > crop->right || crop->right >= jd->width >> scale
+			|| crop->top > crop->bottom || crop->bottom >= jd->height >> scale) {
+			return JDR_PAR;		/* Err: the window is not in the picture */
+		}
+		w = crop->right - crop->left + 1; h = crop->bottom - crop->top + 1;
+		jd->crop = *crop;
+	}
+	if (dst && stride < (size_t)(jd->orient >= 5 ? h : w) * b) return JDR_PAR;	/* Turned 90 deg: rows are as long as the window is high */
+
+	if (w && h) { w--; h--; }	/* Last column and row of the window */
+	switch (jd->orient) {
+	case 2:	jd->dstdx = -b; jd->dstdy = r;  ofs = w * b; break;
+	case 3:	jd->dstdx = -b; jd->dstdy = -r; ofs = w * b + h * r; break;
+	case 4:	jd->dstdx = b;  jd->dstdy = -r; ofs = h * r; break;
+	case 5:	jd->dstdx = r;  jd->dstdy = b;  ofs = 0; break;
+	case 6:	jd->dstdx = r;  jd->dstdy = -b; ofs = h * b; break;
+	case 7:	jd->dstdx = -r; jd->dstdy = -b; ofs = h * b + w * r; break;
+	case 8:	jd->dstdx = -r; jd->dstdy = b;  ofs = w * r; break;
+	default: jd->dstdx = b; jd->dstdy = r;  ofs = 0;
+	}
+	jd->scale = scale;
+	jd->dstbuf = dst ? dst + ofs : 0;	/* Where the top-left pixel of the window goes */
+
+	return JDR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Decompress a range of MCUs starting at a restart interval             */
+/*-----------------------------------------------------------------------*/
+/* For first > 0 the input stream must be positioned at the first byte
+/  that follows the RSTn marker preceding MCU #first, first must be a
+/  multiple of the restart interval and the data already buffered by
+/  jd_prepare() is discarded. This lets several decompression objects,
+/  each prepared on its own stream, decode disjoint parts of an image. */
+
+JRESULT jd_decomp_part (
 	JDEC* jd,								/* Initialized decompression object */
-	int (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function */
-	uint8_t scale							/* Output de-scaling factor (0 to 3) */
+	int (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function (optional if dst is given) */
+	uint8_t* dst,							/* Frame buffer of (width >> scale) x (height >> scale) pixels turned as jd->orient (0:outfunc only) */
+	size_t stride,							/* Distance between rows in the frame buffer (bytes) */
+	uint8_t scale,							/* Output de-scaling factor (0 to 3) */
+	uint32_t first,							/* Index of the first MCU to decompress (raster order) */
+	uint32_t count							/* Number of MCUs to decompress (clipped at the end of image) */
 )
 {
-	unsigned int x, y, mx, my;
+	unsigned int x, y, mx, my, nx;
+	uint32_t nmcu;
 	uint16_t rst, rsc;
 	JRESULT rc;
 
 
-	if (scale > (JD_USE_SCALE ? 3 : 0)) return JDR_PAR;
-	jd->scale = scale;
+	if (!outfunc && !dst) return JDR_PAR;	/* Output function is mandatory unless a frame buffer is given */
 
 	mx = jd->msx * 8; my = jd->msy * 8;			/* Size of the MCU (pixel) */
+	nx = (jd->width + mx - 1) / mx;				/* Number of MCUs in a row */
+	nmcu = mcu_count(jd);
+	if (first >= nmcu) return JDR_PAR;
+	if (count > nmcu - first) count = nmcu - first;
+
+	rsc = 0;
+	if (first) {	/* Starting in the middle of the stream? */
+		if (!jd->nrst || first % jd->nrst) return JDR_PAR;	/* Err: not at a restart interval */
+		rsc = (uint16_t)(first / jd->nrst);		/* Sequense number of the next restart marker */
+		jd->dctr = 0; jd->dbit = 0;				/* Discard the buffered stream, the input function continues from RSTn */
+#if JD_FASTDECODE >= 1
+		jd->wreg = 0; jd->marker = 0;
+#endif
+	}
 
+	rc = set_output(jd, dst, stride, scale, 0);	/* Output the whole picture */
+	if (rc != JDR_OK) return rc;
 	jd->dcv[2] = jd->dcv[1] = jd->dcv[0] = 0;	/* Initialize DC values */
-	rst = rsc = 0;
+	rst = 0;
 
+	x = first % nx * mx; y = first / nx * my;	/* Location of the first MCU */
 	rc = JDR_OK;
-	for (y = 0; y < jd->height; y += my) {		/* Vertical loop of MCUs */
-		for (x = 0; x < jd->width; x += mx) {	/* Horizontal loop of MCUs */
-			if (jd->nrst && rst++ == jd->nrst) {	/* Process restart interval if enabled */
-				rc = restart(jd, rsc++);
-				if (rc != JDR_OK) return rc;
-				rst = 1;
-			}
-			rc = mcu_load(jd);					/* Load an MCU (decompress huffman coded stream, dequantize and apply IDCT) */
-			if (rc != JDR_OK) return rc;
-			rc = mcu_output(jd, outfunc, x, y);	/* Output the MCU (YCbCr to RGB, scaling and output) */
+	while (count--) {
+		if (jd->nrst && rst++ == jd->nrst) {	/* Process restart interval if enabled */
+			rc = restart(jd, rsc++);
+			if (rc != JDR_OK) break;
+			rst = 1;
+		}
+		rc = mcu_load(jd, 1);				/* Load an MCU (decompress huffman coded stream, dequantize and apply IDCT) */
+		if (rc != JDR_OK) break;
+		rc = mcu_output(jd, outfunc, x, y);	/* Output the MCU (YCbCr to RGB, scaling and output) */
+		if (rc != JDR_OK) break;
+		x += mx;							/* Next MCU */
+		if (x >= jd->width) {
+			x = 0; y += my;
+		}
+	}
+	jd->dstbuf = 0;
+
+	return rc;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Start to decompress the JPEG picture                                  */
+/*-----------------------------------------------------------------------*/
+
+JRESULT jd_decomp (
+	JDEC* jd,								/* Initialized decompression object */
+	int (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function */
+	uint8_t scale							/* Output de-scaling factor (0 to 3) */
+)
+{
+	return jd_decomp_part(jd, outfunc, 0, 0, scale, 0, 0xFFFFFFFF);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Decompress the JPEG picture straight into a frame buffer              */
+/*-----------------------------------------------------------------------*/
+
+JRESULT jd_decomp_to_buffer (
+	JDEC* jd,								/* Initialized decompression object */
+	int (*outfunc)(JDEC*, void*, JRECT*),	/* Notification function called after each MCU (optional) */
+	uint8_t* dst,							/* Frame buffer of (width >> scale) x (height >> scale) pixels */
+	size_t stride,							/* Distance between rows in the frame buffer (bytes) */
+	uint8_t scale							/* Output de-scaling factor (0 to 3) */
+)
+{
+	if (!dst) return JDR_PAR;
+
+	return jd_decomp_part(jd, outfunc, dst, stride, scale, 0, 0xFFFFFFFF);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Step-wise and pipelined decompression                                 */
+/*-----------------------------------------------------------------------*/
+/* jd_decomp_start() resets the MCU cursors, then jd_decomp_step() decodes
+/  a given number of MCUs at a time and can be called again later to go on
+/  from where it stopped. Alternatively, jd_pipe_load() runs the entropy
+/  decoding stage of the next MCU into msx * msy + 2 JBLOCKs and
+/  jd_pipe_output() runs the IDCT, color conversion and output stage of
+/  the oldest loaded MCU. The two stages do not share any working state,
+/  so each may run on its own thread as long as every MCU is output once,
+/  in load order, after it is loaded. jd_pipe_idct() runs the IDCT of that
+/  MCU alone, then jd_pipe_output() without blocks does the rest, for the
+/  caller to time the two apart.
+/  jd_decomp_start_crop() limits the output to a window of the descaled
+/  picture: the MCUs out of it are entropy decoded only, without IDCT and
+/  color conversion, and the decompression ends with the last MCU row that
+/  has pixels in it. */
+
+JRESULT jd_decomp_start_crop (
+	JDEC* jd,		/* Initialized decompression object */
+	uint8_t* dst,	/* Frame buffer of the window size, turned as jd->orient (0:output function only) */
+	size_t stride,	/* Distance between rows in the frame buffer (bytes) */
+	uint8_t scale,	/* Output de-scaling factor (0 to 3) */
+	const JRECT* crop	/* Output window in descaled pixels (0:whole picture) */
+)
+{
+	JRESULT rc;
+
+
+	rc = set_output(jd, dst, stride, scale, crop);
+	if (rc != JDR_OK) return rc;
+	jd->dcv[2] = jd->dcv[1] = jd->dcv[0] = 0;	/* Initialize DC values */
+	jd->ldmcu = jd->outmcu = 0;
+
+	return JDR_OK;
+}
+
+
+JRESULT jd_decomp_start (
+	JDEC* jd,		/* Initialized decompression object */
+	uint8_t* dst,	/* Frame buffer of (width >> scale) x (height >> scale) pixels (0:output function only) */
+	size_t stride,	/* Distance between rows in the frame buffer (bytes) */
+	uint8_t scale	/* Output de-scaling factor (0 to 3) */
+)
+{
+	return jd_decomp_start_crop(jd, dst, stride, scale, 0);
+}
+
+
+JRESULT jd_decomp_step (
+	JDEC* jd,		/* Decompression object started by jd_decomp_start() */
+	int (*outfunc)(JDEC*, void*, JRECT*),	/* RGB output function (optional if a frame buffer is given) */
+	uint32_t count	/* Maximum number of MCUs to decompress in this call */
+)
+{
+	unsigned int mx, my, nx, x, y, out;
+	uint32_t nmcu;
+	JRESULT rc;
+
+
+	if (!outfunc && !jd->dstbuf) return JDR_PAR;
+
+	mx = jd->msx * 8; my = jd->msy * 8;			/* Size of the MCU (pixel) */
+	nx = (jd->width + mx - 1) / mx;				/* Number of MCUs in a row */
+	nmcu = mcu_end(jd);
+	while (count-- && jd->ldmcu < nmcu) {
+		if (jd->nrst && jd->ldmcu && jd->ldmcu % jd->nrst == 0) {	/* Process restart interval if enabled */
+			rc = restart(jd, (uint16_t)(jd->ldmcu / jd->nrst - 1));
 			if (rc != JDR_OK) return rc;
 		}
+		x = jd->outmcu % nx * mx; y = jd->outmcu / nx * my;
+		out = mcu_visible(jd, x, y);
+		rc = mcu_load(jd, out);				/* Load an MCU (decompress huffman coded stream, dequantize and apply IDCT) */
+		if (rc != JDR_OK) return rc;
+		jd->ldmcu++;
+		if (out) rc = mcu_output(jd, outfunc, x, y);	/* Output the MCU (YCbCr to RGB, scaling and output) */
+		jd->outmcu++;
+		if (rc != JDR_OK) return rc;
+	}
+
+	return JDR_OK;
+}
+
+
+JRESULT jd_pipe_load (
+	JDEC* jd,		/* Decompression object started by jd_decomp_start() */
+	JBLOCK* blk		/* msx * msy + 2 blocks to store the coefficients of the MCU */
+)
+{
+	unsigned int b, nb, nby;
+	JRESULT rc;
+
+
+	if (jd->ldmcu >= mcu_end(jd)) return JDR_PAR;		/* Err: no MCU left */
+	if (jd->nrst && jd->ldmcu && jd->ldmcu % jd->nrst == 0) {	/* Process restart interval if enabled */
+		rc = restart(jd, (uint16_t)(jd->ldmcu / jd->nrst - 1));
+		if (rc != JDR_OK) return rc;
+	}
+
+	nby = jd->msx * jd->msy;					/* Number of Y blocks (1, 2 or 4) */
+	nb = nby + (jd->ncomp == 3 ? 2 : 0);		/* Number of blocks in the stream */
+	for (b = 0; b < nb; b++) {
+		rc = block_load(jd, (b < nby) ? 0 : b - nby + 1, blk[b].coef, blk[b].nz);
+		if (rc != JDR_OK) return rc;
+	}
+	jd->ldmcu++;
+
+	return JDR_OK;
+}
+
+
+JRESULT jd_pipe_idct (
+	JDEC* jd,		/* Decompression object started by jd_decomp_start() */
+	JBLOCK* blk		/* Blocks filled by jd_pipe_load() (coefficients are destroyed) */
+)
+{
+	unsigned int b, nby, mx, my, nx;
+
+
+	if (jd->outmcu >= mcu_end(jd)) return JDR_PAR;		/* Err: no MCU left */
+
+	mx = jd->msx * 8; my = jd->msy * 8;			/* Size of the MCU (pixel) */
+	nx = (jd->width + mx - 1) / mx;				/* Number of MCUs in a row */
+	if (!mcu_visible(jd, jd->outmcu % nx * mx, jd->outmcu / nx * my)) return JDR_OK;	/* Out of the output window */
+
+	nby = jd->msx * jd->msy;					/* Number of Y blocks (1, 2 or 4) */
+	for (b = 0; b < nby + (jd->ncomp == 3 ? 2 : 0); b++) {	/* IDCT into the MCU buffer (no C blocks in grayscale image) */
+		block_out(jd, (b < nby) ? 0 : b - nby + 1, blk[b].coef, blk[b].nz, jd->mcubuf + b * 64);
+	}
+
+	return JDR_OK;
+}
+
+
+JRESULT jd_pipe_output (
+	JDEC* jd,		/* Decompression object started by jd_decomp_start() */
+	JBLOCK* blk,	/* Blocks filled by jd_pipe_load() (coefficients are destroyed), 0:IDCT done by jd_pipe_idct() */
+	int (*outfunc)(JDEC*, void*, JRECT*)	/* RGB output function (optional if a frame buffer is given) */
+)
+{
+	unsigned int b, nby, mx, my, nx, x, y;
+	JRESULT rc;
+
+
+	if (!outfunc && !jd->dstbuf) return JDR_PAR;
+	if (jd->outmcu >= mcu_end(jd)) return JDR_PAR;		/* Err: no MCU left */
+
+	mx = jd->msx * 8; my = jd->msy * 8;			/* Size of the MCU (pixel) */
+	nx = (jd->width + mx - 1) / mx;				/* Number of MCUs in a row */
+	x = jd->outmcu % nx * mx; y = jd->outmcu / nx * my;
+	jd->outmcu++;
+	if (!mcu_visible(jd, x, y)) return JDR_OK;	/* Out of the output window */
+
+	nby = jd->msx * jd->msy;					/* Number of Y blocks (1, 2 or 4) */
+	for (b = 0; blk && b < nby + (jd->ncomp == 3 ? 2 : 0); b++) {	/* IDCT into the MCU buffer (no C blocks in grayscale image) */
+		block_out(jd, (b < nby) ? 0 : b - nby + 1, blk[b].coef, blk[b].nz, jd->mcubuf + b * 64);
 	}
+	rc = mcu_output(jd, outfunc, x, y);
 
 	return rc;
 }
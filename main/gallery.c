@@ -14,18 +14,31 @@
 
 #define GALLERY_QUEUE_DEPTH 10
 #define GALLERY_THUMB_BATCH 4
+#define GALLERY_DECODE_STEP_ROWS 4 // MCU rows decoded between two looks at the command queue
+#define GALLERY_PREVIEW_DRAW_MS 40 // a refresh period or so, for LVGL to draw the preview before the full decode
+#define GALLERY_POOL_FRAMES 3      // the image shown, the one being decoded and one in the event queue
+#define GALLERY_POOL_THUMB_SLAB 32 // thumbnails allocated at once, every thumbnail stays in memory
+// Images are decoded with rows aligned as LVGL draw buffers, shown as they are
+#ifdef CONFIG_LV_DRAW_BUF_STRIDE_ALIGN
+#define GALLERY_STRIDE_ALIGN CONFIG_LV_DRAW_BUF_STRIDE_ALIGN
+#else
+#define GALLERY_STRIDE_ALIGN 1
+#endif
 
 typedef enum {
     GALLERY_CMD_LOAD_INDEX = 0,
     GALLERY_CMD_NEXT,
     GALLERY_CMD_PREV,
     GALLERY_CMD_REFRESH,
+    GALLERY_CMD_ZOOM,
+    GALLERY_CMD_ROTATE,
     GALLERY_CMD_STOP
 } gallery_cmd_id_t;
 
 typedef struct {
     gallery_cmd_id_t id;
     size_t index;
+    bool preview; // LOAD_INDEX, NEXT, PREV: show a 1/8 preview first, the user is waiting for the picture
 } gallery_cmd_t;
 
 typedef struct {
@@ -47,6 +60,15 @@ static TaskHandle_t s_task_handle = NULL;
 static esp_timer_handle_t s_slideshow_timer = NULL;
 static bool s_running = false;
 static bool s_slideshow_enabled = false;
+// Set by the navigation calls, stops the full-size decode in progress
+static volatile bool s_decode_cancel = false;
+static volatile bool s_zoomed = false;
+static bool s_shown_zoomed = false; // the last image sent is a zoomed region
+static volatile uint16_t s_rotation = 0;
+static uint16_t s_shown_rotation = 0; // rotation of the last image sent
+static uint16_t s_shown_scale = 256;  // LVGL scale of the last image sent, above 256 for a preview
+// Full-size pictures are read whole into it and decoded from memory; owned by the gallery task
+static jpeg_file_buffer_t s_file;
 
 static bool has_jpg_extension(const char *name)
 {
@@ -118,7 +140,8 @@ static esp_err_t gallery_scan_directory(const char *path)
     return s_entry_count > 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
 }
 
-static void gallery_event_emit(gallery_event_id_t id, size_t index, jpeg_image_t *image, esp_err_t status, const char *message)
+static void gallery_event_emit(gallery_event_id_t id, size_t index, jpeg_image_t *image, esp_err_t status, const char *message,
+                               const jpeg_decode_stats_t *stats)
 {
     if (!s_config.event_cb) {
         return;
@@ -126,6 +149,10 @@ static void gallery_event_emit(gallery_event_id_t id, size_t index, jpeg_image_t
     gallery_event_t evt = {
         .id = id,
         .index = index,
+        .zoomed = id == GALLERY_EVENT_IMAGE_READY && s_shown_zoomed,
+        .rotation = id == GALLERY_EVENT_IMAGE_READY ? s_shown_rotation : 0,
+        .preview = id == GALLERY_EVENT_IMAGE_READY && s_shown_scale != 256,
+        .scale = id == GALLERY_EVENT_IMAGE_READY ? s_shown_scale : 256,
         .status = status,
         .message = message,
     };
@@ -134,6 +161,9 @@ static void gallery_event_emit(gallery_event_id_t id, size_t index, jpeg_image_t
     } else {
         memset(&evt.image, 0, sizeof(evt.image));
     }
+    if (stats) {
+        evt.stats = *stats;
+    }
     s_config.event_cb(&evt, s_config.event_ctx);
 }
 
@@ -151,16 +181,16 @@ static size_t gallery_process_thumb_batch(const jpeg_decode_options_t *opts)
         gallery_entry_t *entry = &s_entries[idx];
         if (!entry->thumb_valid) {
             jpeg_image_t thumb;
-            if (jpeg_decode_file(entry->path, opts, &thumb) == ESP_OK) {
+            if (jpeg_decode_thumbnail(entry->path, opts, &thumb) == ESP_OK) {
                 entry->thumb = thumb;
                 entry->thumb_valid = true;
                 if (s_pending_thumbs > 0) {
                     s_pending_thumbs--;
                 }
-                gallery_event_emit(GALLERY_EVENT_THUMBNAIL_READY, idx, &entry->thumb, ESP_OK, NULL);
+                gallery_event_emit(GALLERY_EVENT_THUMBNAIL_READY, idx, &entry->thumb, ESP_OK, NULL, opts->stats);
                 processed++;
             } else {
-                gallery_event_emit(GALLERY_EVENT_ERROR, idx, NULL, ESP_FAIL, "thumbnail decode failed");
+                gallery_event_emit(GALLERY_EVENT_ERROR, idx, NULL, ESP_FAIL, "thumbnail decode failed", opts->stats);
             }
         }
         scanned++;
@@ -173,36 +203,207 @@ static size_t gallery_process_thumb_batch(const jpeg_decode_options_t *opts)
     return processed;
 }
 
-static esp_err_t gallery_decode_at(size_t index, jpeg_decode_options_t *opts)
+// A navigation command waiting in the queue makes the image being decoded obsolete.
+static bool gallery_decode_superseded(void)
+{
+    gallery_cmd_t cmd;
+    if (xQueuePeek(s_cmd_queue, &cmd, 0) != pdTRUE) {
+        return false;
+    }
+    return cmd.id != GALLERY_CMD_REFRESH;
+}
+
+static uint8_t gallery_fit_scale(uint16_t width, uint16_t height, const jpeg_decode_options_t *opts)
+{
+    uint8_t scale = 0;
+    while (scale < 3 && ((width >> scale) > opts->max_width || (height >> scale) > opts->max_height)) {
+        scale++;
+    }
+    return scale;
+}
+
+// Zoomed in, decode the centred half of the picture with more pixels instead
+// of letting LVGL scale up the fitted image. Returns false when the picture
+// has no more resolution to give, the viewer scales it up then. `info` is
+// NULL when the picture could not be probed.
+static bool gallery_zoom_region(const jpeg_info_t *info, const jpeg_decode_options_t *opts, jpeg_decode_options_t *region)
+{
+    if (!s_zoomed || !info) {
+        return false;
+    }
+    *region = *opts;
+    region->crop_x = info->width / 4;
+    region->crop_y = info->height / 4;
+    region->crop_width = info->width / 2;
+    region->crop_height = info->height / 2;
+    // The region is in stored pixels, fitted to the screen once turned
+    bool transposed = (opts->auto_orient && info->orientation >= 5) != (opts->rotation % 180 != 0);
+    if (opts->exact_fit) {
+        // Fitted to the box like the whole picture, the region is twice as
+        // large on screen when it has at least the box's pixels
+        return transposed ? region->crop_height >= opts->max_width || region->crop_width >= opts->max_height
+                          : region->crop_width >= opts->max_width || region->crop_height >= opts->max_height;
+    }
+    if (transposed) {
+        return gallery_fit_scale(region->crop_height, region->crop_width, opts) <
+               gallery_fit_scale(info->height, info->width, opts);
+    }
+    return gallery_fit_scale(region->crop_width, region->crop_height, opts) <
+           gallery_fit_scale(info->width, info->height, opts);
+}
+
+// Steps of a decode until it is done or a navigation command supersedes it
+static esp_err_t gallery_decode_steps(jpeg_decoder_t *decoder, jpeg_image_t *img)
+{
+    // The cancel flag catches commands queued during the decode, the queue
+    // check those queued before it started.
+    while (jpeg_decoder_step(decoder, GALLERY_DECODE_STEP_ROWS) == ESP_ERR_NOT_FINISHED && !gallery_decode_superseded()) {
+    }
+    return jpeg_decoder_finish(decoder, img);
+}
+
+// Before the full decode of a newly shown picture, a 1/8 decode of it: tjpgd
+// takes only the DC coefficient of every block then, no IDCT, and writes a
+// 64th of the pixels, so the viewer has something to show (scaled up by LVGL)
+// within a few tens of milliseconds. Skipped when the full-size image is
+// decoded at 1/8 anyway. `info` is NULL when the picture could not be probed,
+// `loaded` tells whether it is in s_file. Returns whether a preview was shown.
+static bool gallery_preview(size_t index, const jpeg_info_t *info, bool loaded, const jpeg_decode_options_t *opts)
+{
+    if (!info) {
+        return false;
+    }
+    // The box and the images are in the output orientation
+    bool transposed = (opts->auto_orient && info->orientation >= 5) != (opts->rotation % 180 != 0);
+    uint32_t width = transposed ? info->height : info->width;
+    uint32_t height = transposed ? info->width : info->height;
+    // Size of the full-size image: fitted exactly into the box, never
+    // enlarged, or reduced by a power of two to fit it
+    uint32_t full_width = width, full_height = height;
+    if (!opts->exact_fit) {
+        uint8_t scale = gallery_fit_scale(width, height, opts);
+        full_width >>= scale;
+        full_height >>= scale;
+    } else if ((uint64_t)width * opts->max_height > (uint64_t)height * opts->max_width) {
+        if (width > opts->max_width) {
+            full_width = opts->max_width;
+            full_height = (uint32_t)((uint64_t)height * opts->max_width / width);
+        }
+    } else if (height > opts->max_height) {
+        full_width = (uint32_t)((uint64_t)width * opts->max_height / height);
+        full_height = opts->max_height;
+    }
+    if (!(width >> 3) || !(height >> 3) || (width >> 3 >= full_width && height >> 3 >= full_height)) {
+        return false;
+    }
+
+    jpeg_decode_options_t preview = *opts;
+    preview.max_width = width >> 3;
+    preview.max_height = height >> 3;
+    preview.reduce_to_fit = true;
+    preview.exact_fit = false;
+    preview.stats = NULL;
+    preview.pipeline_stats = NULL;
+    jpeg_decoder_t *decoder;
+    jpeg_image_t img;
+    esp_err_t err = loaded ? jpeg_decoder_begin_memory(s_file.data, s_file.size, &preview, &decoder)
+                           : jpeg_decoder_begin(s_entries[index].path, &preview, &decoder);
+    if (err == ESP_OK) {
+        err = gallery_decode_steps(decoder, &img);
+    }
+    if (err != ESP_OK) {
+        return false; // the full decode reports the errors of the picture
+    }
+    s_shown_zoomed = false;
+    s_shown_rotation = opts->rotation;
+    s_shown_scale = (uint16_t)(full_width * 256 / img.width);
+    gallery_event_emit(GALLERY_EVENT_IMAGE_READY, index, &img, ESP_OK, NULL, NULL);
+    return true;
+}
+
+static esp_err_t gallery_decode_at(size_t index, jpeg_decode_options_t *opts, bool preview)
 {
     if (index >= s_entry_count) {
         return ESP_ERR_INVALID_ARG;
     }
+    // Navigation moves on from the requested image even if its decode is
+    // cancelled, so that several quick NEXT commands skip ahead.
+    s_current = index;
+    s_decode_cancel = false;
+    opts->rotation = s_rotation;
+    // The whole file in one read, instead of a VFS call per 4 KB during the
+    // decode; pictures too large for the buffer are decoded from the file.
+    const char *path = s_entries[index].path;
+    bool loaded = jpeg_file_load(path, &s_file) == ESP_OK;
+    jpeg_info_t info;
+    bool probed = (loaded ? jpeg_probe_memory(s_file.data, s_file.size, &info) : jpeg_probe_file(path, &info)) == ESP_OK;
+    jpeg_decode_options_t region;
+    bool zoomed = gallery_zoom_region(probed ? &info : NULL, opts, &region);
+    if (preview && !zoomed) {
+        // The full decode keeps both cores busy, let the UI task (lower
+        // priority) draw the preview first
+        if (gallery_preview(index, probed ? &info : NULL, loaded, opts)) {
+            vTaskDelay(pdMS_TO_TICKS(GALLERY_PREVIEW_DRAW_MS));
+        }
+        if (gallery_decode_superseded() || s_decode_cancel) {
+            ESP_LOGD(TAG, "Decode of %u cancelled", (unsigned)index);
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    jpeg_decoder_t *decoder;
     jpeg_image_t img;
-    esp_err_t err = jpeg_decode_file(s_entries[index].path, opts, &img);
+    esp_err_t err = loaded ? jpeg_decoder_begin_memory(s_file.data, s_file.size, zoomed ? &region : opts, &decoder)
+                           : jpeg_decoder_begin(path, zoomed ? &region : opts, &decoder);
     if (err == ESP_OK) {
-        s_current = index;
-        gallery_event_emit(GALLERY_EVENT_IMAGE_READY, index, &img, ESP_OK, NULL);
+        err = gallery_decode_steps(decoder, &img);
+    }
+    if (err == ESP_OK) {
+        s_shown_zoomed = zoomed;
+        s_shown_rotation = opts->rotation;
+        s_shown_scale = 256;
+        gallery_event_emit(GALLERY_EVENT_IMAGE_READY, index, &img, ESP_OK, NULL, opts->stats);
         // ownership of img pixels transferred to callback
+    } else if (err == ESP_ERR_INVALID_STATE) {
+        ESP_LOGD(TAG, "Decode of %u cancelled", (unsigned)index);
     } else {
-        gallery_event_emit(GALLERY_EVENT_ERROR, index, NULL, err, "decode failed");
+        gallery_event_emit(GALLERY_EVENT_ERROR, index, NULL, err, "decode failed", opts->stats);
     }
     return err;
 }
 
 static void gallery_task(void *arg)
 {
+    jpeg_decode_stats_t full_stats = {0};
+    jpeg_decode_stats_t thumb_stats = {0};
     jpeg_decode_options_t full_opts = {
         .max_width = APP_LCD_H_RES,
         .max_height = APP_LCD_V_RES,
         .reduce_to_fit = true,
         .use_psram = true,
+        .huffman_lut = true,
+        .parallel = true,
+        .pipeline_depth = 8,
+        .pipeline_batch = 2,
+        .auto_orient = true,
+        .exact_fit = true,
+        .cancel = &s_decode_cancel,
+        .stats = &full_stats,
+        .read_ahead = 2, // pictures too large for s_file are decoded from the file
+        .stride_align = GALLERY_STRIDE_ALIGN,
     };
     jpeg_decode_options_t thumb_opts = {
         .max_width = s_config.thumb_long_side,
         .max_height = s_config.thumb_short_side,
         .reduce_to_fit = true,
         .use_psram = true,
+        .huffman_lut = true,
+        // Thumbnails are decoded in the background, leave the other core to LVGL.
+        .parallel = false,
+        .auto_orient = true,
+        .exact_fit = true,
+        .stats = &thumb_stats,
+        .read_ahead = 2,
+        .stride_align = GALLERY_STRIDE_ALIGN,
     };
     gallery_cmd_t cmd;
     while (s_running) {
@@ -211,18 +412,34 @@ static void gallery_task(void *arg)
         }
         switch (cmd.id) {
         case GALLERY_CMD_LOAD_INDEX:
-            gallery_decode_at(cmd.index, &full_opts);
+            gallery_decode_at(cmd.index, &full_opts, cmd.preview);
             break;
         case GALLERY_CMD_NEXT:
             if (s_entry_count) {
                 size_t next = (s_current + 1) % s_entry_count;
-                gallery_decode_at(next, &full_opts);
+                gallery_decode_at(next, &full_opts, cmd.preview);
             }
             break;
         case GALLERY_CMD_PREV:
             if (s_entry_count) {
                 size_t prev = (s_current + s_entry_count - 1) % s_entry_count;
-                gallery_decode_at(prev, &full_opts);
+                gallery_decode_at(prev, &full_opts, cmd.preview);
+            }
+            break;
+        case GALLERY_CMD_ZOOM:
+            // Only decode again if the current image would change
+            if (s_entry_count) {
+                jpeg_info_t info;
+                bool probed = jpeg_probe_file(s_entries[s_current].path, &info) == ESP_OK;
+                jpeg_decode_options_t region;
+                if (gallery_zoom_region(probed ? &info : NULL, &full_opts, &region) != s_shown_zoomed) {
+                    gallery_decode_at(s_current, &full_opts, false);
+                }
+            }
+            break;
+        case GALLERY_CMD_ROTATE:
+            if (s_entry_count && s_rotation != s_shown_rotation) {
+                gallery_decode_at(s_current, &full_opts, false);
             }
             break;
         case GALLERY_CMD_REFRESH:
@@ -238,12 +455,27 @@ static void gallery_task(void *arg)
             break;
         }
     }
+    jpeg_file_buffer_release(&s_file);
     vTaskDelete(NULL);
 }
 
+// Bytes of the largest image decoded to fit a width x height box
+static size_t gallery_image_size(uint16_t width, uint16_t height)
+{
+    size_t row = (size_t)width * jpeg_pixel_size(JPEG_PIXEL_FORMAT_RGB565);
+    return (row + GALLERY_STRIDE_ALIGN - 1) / GALLERY_STRIDE_ALIGN * GALLERY_STRIDE_ALIGN * height;
+}
+
+// Same as gallery_next(), without a preview: nobody is waiting for the next
+// slide, it only shows once sharp
 static void slideshow_timer_cb(void *arg)
 {
-    gallery_next();
+    if (!s_running || !s_cmd_queue) {
+        return;
+    }
+    gallery_cmd_t cmd = {.id = GALLERY_CMD_NEXT};
+    s_decode_cancel = true;
+    xQueueSend(s_cmd_queue, &cmd, 0);
 }
 
 esp_err_t gallery_start(const gallery_config_t *config)
@@ -267,6 +499,11 @@ esp_err_t gallery_start(const gallery_config_t *config)
     s_refresh_cursor = 0;
     s_pending_thumbs = 0;
     s_slideshow_enabled = false;
+    s_zoomed = false;
+    s_shown_zoomed = false;
+    s_rotation = 0;
+    s_shown_rotation = 0;
+    s_shown_scale = 256;
 
     esp_err_t err = gallery_scan_directory(s_config.root_path);
     if (err != ESP_OK) {
@@ -278,6 +515,20 @@ esp_err_t gallery_start(const gallery_config_t *config)
 
     s_pending_thumbs = s_entry_count;
 
+    // Full-size images and thumbnails in buffers of their own size, kept from
+    // one picture to the next (and across gallery_stop()), so that swiping and
+    // the slideshow do not allocate. Images that do not fit come from the heap.
+    const jpeg_pool_class_t pool[] = {
+        {.buffer_size = gallery_image_size(APP_LCD_H_RES, APP_LCD_V_RES), .slab_count = 2,
+         .max_count = GALLERY_POOL_FRAMES},
+        {.buffer_size = gallery_image_size(s_config.thumb_long_side, s_config.thumb_short_side),
+         .slab_count = GALLERY_POOL_THUMB_SLAB, .max_count = APP_GALLERY_MAX_IMAGES},
+    };
+    err = jpeg_image_pool_init(pool, sizeof(pool) / sizeof(pool[0]), true);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGW(TAG, "No image pool (%s), images allocated one by one", esp_err_to_name(err));
+    }
+
     s_cmd_queue = xQueueCreate(GALLERY_QUEUE_DEPTH, sizeof(gallery_cmd_t));
     if (!s_cmd_queue) {
         gallery_reset_entries();
@@ -360,6 +611,7 @@ void gallery_stop(void)
         return;
     }
     gallery_cmd_t cmd = {.id = GALLERY_CMD_STOP};
+    s_decode_cancel = true;
     xQueueSend(s_cmd_queue, &cmd, portMAX_DELAY);
     if (s_slideshow_timer) {
         esp_timer_stop(s_slideshow_timer);
@@ -377,6 +629,16 @@ void gallery_stop(void)
     gallery_reset_entries();
     s_running = false;
     s_slideshow_enabled = false;
+
+    jpeg_pool_stats_t pool;
+    jpeg_image_pool_get_stats(&pool);
+    for (uint8_t i = 0; i < pool.class_count; ++i) {
+        ESP_LOGI(TAG, "Image pool %u B: %u buffers, at most %u in use, %u images", (unsigned)pool.classes[i].buffer_size,
+                 pool.classes[i].count, pool.classes[i].high_water, (unsigned)pool.classes[i].images);
+    }
+    if (pool.class_count) {
+        ESP_LOGI(TAG, "Image pool: %u images allocated from the heap", (unsigned)pool.misses);
+    }
 }
 
 esp_err_t gallery_next(void)
@@ -384,7 +646,8 @@ esp_err_t gallery_next(void)
     if (!s_running || !s_cmd_queue) {
         return ESP_ERR_INVALID_STATE;
     }
-    gallery_cmd_t cmd = {.id = GALLERY_CMD_NEXT};
+    gallery_cmd_t cmd = {.id = GALLERY_CMD_NEXT, .preview = true};
+    s_decode_cancel = true; // the image being decoded would be replaced right away
     return xQueueSend(s_cmd_queue, &cmd, 0) == pdTRUE ? ESP_OK : ESP_FAIL;
 }
 
@@ -393,7 +656,8 @@ esp_err_t gallery_prev(void)
     if (!s_running || !s_cmd_queue) {
         return ESP_ERR_INVALID_STATE;
     }
-    gallery_cmd_t cmd = {.id = GALLERY_CMD_PREV};
+    gallery_cmd_t cmd = {.id = GALLERY_CMD_PREV, .preview = true};
+    s_decode_cancel = true; // the image being decoded would be replaced right away
     return xQueueSend(s_cmd_queue, &cmd, 0) == pdTRUE ? ESP_OK : ESP_FAIL;
 }
 
@@ -405,7 +669,8 @@ esp_err_t gallery_goto(size_t index)
     if (index >= s_entry_count) {
         return ESP_ERR_INVALID_ARG;
     }
-    gallery_cmd_t cmd = {.id = GALLERY_CMD_LOAD_INDEX, .index = index};
+    gallery_cmd_t cmd = {.id = GALLERY_CMD_LOAD_INDEX, .index = index, .preview = true};
+    s_decode_cancel = true; // the image being decoded would be replaced right away
     return xQueueSend(s_cmd_queue, &cmd, 0) == pdTRUE ? ESP_OK : ESP_FAIL;
 }
 
@@ -480,6 +745,31 @@ bool gallery_is_slideshow_enabled(void)
     return s_slideshow_enabled;
 }
 
+esp_err_t gallery_set_zoom(bool zoomed)
+{
+    if (!s_running || !s_cmd_queue) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_zoomed = zoomed;
+    gallery_cmd_t cmd = {.id = GALLERY_CMD_ZOOM};
+    s_decode_cancel = true; // the ZOOM command decodes the current image again with the new setting
+    return xQueueSend(s_cmd_queue, &cmd, 0) == pdTRUE ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t gallery_set_rotation(uint16_t degrees)
+{
+    if (degrees % 90) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_running || !s_cmd_queue) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_rotation = degrees % 360;
+    gallery_cmd_t cmd = {.id = GALLERY_CMD_ROTATE};
+    s_decode_cancel = true; // the ROTATE command decodes the current image again turned
+    return xQueueSend(s_cmd_queue, &cmd, 0) == pdTRUE ? ESP_OK : ESP_FAIL;
+}
+
 size_t gallery_image_count(void)
 {
     return s_entry_count;
@@ -20,8 +20,16 @@ typedef struct {
     gallery_event_id_t id;
     size_t index;
     jpeg_image_t image;
+    bool zoomed; // IMAGE_READY: image is the centred half of the picture at twice the resolution (gallery_set_zoom)
+    uint16_t rotation; // IMAGE_READY: clockwise degrees the image is turned by, on top of its EXIF orientation (gallery_set_rotation)
+    // IMAGE_READY: a quick 1/8 decode of a newly shown picture, the full-size
+    // image follows unless the user moves on; scale (256 for 1:1) shows it as
+    // large as the full-size one will be, 256 for full-size images.
+    bool preview;
+    uint16_t scale;
     esp_err_t status;
     const char *message;
+    jpeg_decode_stats_t stats; // IMAGE_READY (not previews), THUMBNAIL_READY and decode ERROR: where the decode time went
 } gallery_event_t;
 
 typedef void (*gallery_event_cb_t)(const gallery_event_t *event, void *user_ctx);
@@ -43,6 +51,12 @@ esp_err_t gallery_goto(size_t index);
 esp_err_t gallery_refresh_thumbnails(void);
 esp_err_t gallery_set_slideshow_enabled(bool enabled);
 bool gallery_is_slideshow_enabled(void);
+// Zoomed in, full-size images are decoded as their centred half at twice the
+// resolution when the picture has it; re-decodes the current image if needed.
+esp_err_t gallery_set_zoom(bool zoomed);
+// Full-size images are decoded turned clockwise by `degrees` (0, 90, 180 or
+// 270), on top of the orientation their EXIF tag gives; re-decodes the current image.
+esp_err_t gallery_set_rotation(uint16_t degrees);
 size_t gallery_image_count(void);
 size_t gallery_current_index(void);
 const char *gallery_image_path(size_t index);
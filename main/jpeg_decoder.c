@@ -1,22 +1,250 @@
 #include "jpeg_decoder.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "esp_log.h"
 #include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "tjpgd.h"
+#ifdef ESP_PLATFORM
+#include "esp_pthread.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
 
 #define WORKBUF_SIZE 4096
+// Stream input buffer: a whole FAT cluster per read instead of JD_SZBUF bytes
+#define INPUT_BUFFER_SIZE 4096
+#if JD_FASTDECODE == 2
+// Huffman lookup tables: 2 x (1024 AC entries x 2 bytes + 1024 DC entries)
+#define WORKBUF_LUT_SIZE (WORKBUF_SIZE + 6144)
+#endif
+
+// Restart-interval parallel decode: one part per core, the whole file is
+// loaded in PSRAM so that every part can start reading at its RSTn marker.
+#define PARALLEL_PARTS 2
+#define PARALLEL_MAX_FILE_SIZE (8 * 1024 * 1024)
+#define WORKER_TASK_STACK 4096
+
+// Read-ahead ring (jpeg_decode_options_t.read_ahead)
+#define READ_AHEAD_MAX 4
+#define READER_TASK_STACK 3072
+
+// Pipelined decode: yields before a stage blocks on the other one
+#define PIPELINE_SPIN 32
+
+// Image buffer pool: buffers start on a PSRAM cache line, a class grows
+// POOL_MAX_SLABS times at most
+#define POOL_ALIGN 64
+#define POOL_MAX_SLABS 16
+
+// jpeg_file_load(): whole sectors, so that FATFS reads straight into the buffer
+#define FILE_BUFFER_ALIGN 512
+#define FILE_BUFFER_MAX_SIZE (8 * 1024 * 1024)
+
+// Exact fit: area-average of the decoded window (src_*) into the output
+// (dst_*, picture orientation), fed one MCU row at a time. Every source pixel
+// spans dst_width units across and output pixels src_width units, likewise
+// vertically, so the weights are the overlaps in those units and an output
+// pixel adds up to src_width x src_height of them. tjpgd outputs RGB888 (or
+// L8) for it, whatever the image format.
+typedef struct {
+    uint16_t src_width;
+    uint16_t src_height;
+    uint16_t dst_width;
+    uint16_t dst_height;
+    uint8_t channels;  // 3 for R, G, B, 1 for an L8 image
+    jpeg_pixel_format_t format;
+    uint8_t *band;     // MCU row being output by tjpgd, src_width pixels a row
+    uint32_t *xmap;    // per source pixel: its weight in the output pixel, | 1 << 16 if that one ends there (the rest goes to the next)
+    uint32_t *hsum;    // dst_width x channels sums of one source row
+    uint32_t *vsum;    // dst_width x channels sums of the output row being built
+    uint64_t recip;    // 2^40 / (src_width x src_height)
+    uint32_t src_y;    // next source row
+    uint32_t dst_y;    // output row being built
+    uint8_t *out;      // pixel 0,0 of the output, turned as the image is
+    int32_t out_dx;    // bytes between horizontally/vertically adjacent output pixels
+    int32_t out_dy;
+} jpeg_resampler_t;
+
+// Read-ahead: a task reads the file into a ring of buffers while the decoder
+// consumes them. Each side owns its cursor; the lock is only taken to hand a
+// whole buffer over or to wait for one, never per input call.
+typedef struct {
+    FILE *file;
+    uint8_t *buffers; // count x size bytes
+    size_t size;
+    uint32_t count;
+    size_t lengths[READ_AHEAD_MAX]; // bytes read into each buffer, less than size at the end of the file
+    atomic_uint_fast32_t filled;    // buffers written by the reader
+    atomic_uint_fast32_t consumed;  // buffers released by the decoder
+    atomic_bool eof;                // set with the last buffer
+    atomic_bool stop;
+    size_t pos;       // decoder's offset in buffer `consumed`
+    uint32_t read_us; // reader's time in fread()
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} jpeg_reader_t;
 
 typedef struct {
     FILE *file;
-    uint8_t workbuf[WORKBUF_SIZE];
-    jpeg_image_t *image;
+    jpeg_reader_t *reader; // file read ahead by a task, used instead of file when set
+    const uint8_t *data; // whole file in memory, used instead of file when set
+    size_t size;
+    size_t pos;
+    uint8_t *workbuf;
+    size_t workbuf_size;
+    size_t inbuf_size; // JDEC.szbuf, included in workbuf_size
+    const volatile bool *cancel; // jpeg_decode_options_t.cancel
+    const atomic_bool *abandon;  // set by jpeg_decoder_finish() on an incomplete decode
+    jpeg_resampler_t *resampler; // exact fit, tjpgd outputs MCUs for it instead of writing the image
+    jpeg_decode_stats_t *stats;  // input calls are timed and counted into it when set
 } jpeg_decoder_ctx_t;
 
-static size_t tj_input(JDEC *jd, uint8_t *buf, size_t len)
+// Two-stage pipeline: the caller runs huffman decoding into a ring of
+// coefficient MCUs, a thread on the other core runs IDCT and colour output.
+// Each side only publishes its counter every `batch` MCUs, and before waiting.
+// A stage spins a little on the other one, then sleeps on the condition.
+typedef struct {
+    JDEC *decoder;
+    JBLOCK *ring; // depth slots of nblocks blocks
+    size_t nblocks;
+    uint32_t depth;
+    uint32_t batch;
+    uint32_t nmcu;
+    uint32_t load_done;          // load stage cursors, kept between jpeg_decoder_step() calls
+    uint32_t load_freed;
+    atomic_uint_fast32_t loaded; // MCUs published by the load stage
+    atomic_uint_fast32_t output; // MCUs released by the output stage
+    atomic_int error;            // first JRESULT error of either stage
+    atomic_int sleepers;         // stages waiting on cond, the other one signals it when set
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    jpeg_pipeline_stats_t stats; // load_* written by the load stage, output_* by the output stage
+    jpeg_decode_stats_t *timing; // when set, huffman_us added by the load stage, idct_us and output_us by the output stage
+} jpeg_pipeline_t;
+
+typedef struct {
+    jpeg_decoder_ctx_t ctx;
+    size_t offset; // stream offset of MCU #first, 0 to follow the headers
+    uint32_t first;
+    uint32_t count;
+    uint8_t *dst;
+    size_t stride;
+    uint8_t scale;
+    uint8_t orient;
+    jpeg_pixel_format_t format;
+    JRESULT res;
+} jpeg_part_t;
+
+// A class of the image buffer pool: the free buffers are on a stack, the
+// slabs are only freed by jpeg_image_pool_deinit()
+typedef struct {
+    size_t stride; // buffer_size rounded up to POOL_ALIGN
+    uint16_t slab_count;
+    uint16_t max_count;
+    uint8_t *slabs[POOL_MAX_SLABS]; // allocated blocks, the first buffer is aligned up to POOL_ALIGN
+    uint16_t slab_len[POOL_MAX_SLABS]; // buffers in each slab, the last one may be short of slab_count
+    uint16_t nslabs;
+    uint8_t **free; // max_count entries
+    uint16_t nfree;
+    jpeg_pool_class_stats_t stats;
+} jpeg_pool_class_state_t;
+
+typedef enum {
+    DECODE_SERIAL = 0,
+    DECODE_PARALLEL,
+    DECODE_PIPELINED,
+} decode_mode_t;
+
+// The caller's JDEC decodes MCUs [ldmcu, end) step by step; in parallel mode
+// the rest of the image is decoded by helper threads, in pipelined mode the
+// caller only runs the huffman stage and the other core does the output.
+struct jpeg_decoder {
+    jpeg_decoder_ctx_t ctx;
+    JDEC decoder;
+    jpeg_decode_options_t opts;
+    jpeg_image_t image;
+    uint8_t orient; // EXIF orientation code the image is written in (JDEC.orient)
+    decode_mode_t mode;
+    esp_err_t status; // ESP_ERR_NOT_FINISHED while MCUs are left
+    atomic_bool abandon;
+    uint32_t nmcu;
+    uint32_t end;
+    uint32_t mcus_per_row;
+    int64_t start_us;
+    jpeg_decode_stats_t stats; // copied to opts.stats by jpeg_decoder_finish()
+    JBLOCK *blocks;            // DECODE_SERIAL with opts.stats: one MCU, to time the stages apart
+    jpeg_reader_t reader;      // opts.read_ahead
+    bool reader_started;
+    // DECODE_PARALLEL
+    uint8_t *data;
+    jpeg_part_t parts[PARALLEL_PARTS];
+    size_t nparts;
+    pthread_t threads[PARALLEL_PARTS];
+    size_t started;
+    // DECODE_PIPELINED
+    jpeg_pipeline_t pipe;
+    pthread_t pipe_thread;
+    bool pipe_started;
+};
+
+// Take up to len bytes from the read-ahead ring, waiting for the reader when it is empty.
+static size_t reader_read(jpeg_reader_t *rd, uint8_t *buf, size_t len)
 {
-    jpeg_decoder_ctx_t *ctx = (jpeg_decoder_ctx_t *)jd->device;
+    size_t done = 0;
+    while (done < len) {
+        uint32_t c = atomic_load_explicit(&rd->consumed, memory_order_relaxed);
+        if (c == atomic_load_explicit(&rd->filled, memory_order_acquire)) {
+            pthread_mutex_lock(&rd->lock);
+            while (c == atomic_load(&rd->filled) && !atomic_load(&rd->eof)) {
+                pthread_cond_wait(&rd->cond, &rd->lock);
+            }
+            pthread_mutex_unlock(&rd->lock);
+            if (c == atomic_load_explicit(&rd->filled, memory_order_acquire)) {
+                break; // end of file
+            }
+        }
+        size_t length = rd->lengths[c % rd->count];
+        size_t n = length - rd->pos < len - done ? length - rd->pos : len - done;
+        if (buf) {
+            memcpy(buf + done, rd->buffers + (c % rd->count) * rd->size + rd->pos, n);
+        }
+        rd->pos += n;
+        done += n;
+        if (rd->pos == length) { // hand the buffer back
+            rd->pos = 0;
+            pthread_mutex_lock(&rd->lock);
+            atomic_store_explicit(&rd->consumed, c + 1, memory_order_release);
+            pthread_cond_broadcast(&rd->cond);
+            pthread_mutex_unlock(&rd->lock);
+        }
+    }
+    return done;
+}
+
+static size_t read_input(jpeg_decoder_ctx_t *ctx, uint8_t *buf, size_t len)
+{
+    if (ctx->reader) {
+        return reader_read(ctx->reader, buf, len);
+    }
+    if (ctx->data) {
+        if (len > ctx->size - ctx->pos) {
+            len = ctx->size - ctx->pos;
+        }
+        if (buf) {
+            memcpy(buf, ctx->data + ctx->pos, len);
+        }
+        ctx->pos += len;
+        return len;
+    }
     if (buf) {
         return fread(buf, 1, len, ctx->file);
     }
@@ -24,17 +252,159 @@ static size_t tj_input(JDEC *jd, uint8_t *buf, size_t len)
     return len;
 }
 
-static int tj_output(JDEC *jd, void *bitmap, JRECT *rect)
+static size_t tj_input(JDEC *jd, uint8_t *buf, size_t len)
 {
     jpeg_decoder_ctx_t *ctx = (jpeg_decoder_ctx_t *)jd->device;
-    jpeg_image_t *img = ctx->image;
-    uint16_t *src = (uint16_t *)bitmap;
-    for (int y = rect->top; y <= rect->bottom; ++y) {
-        uint16_t *dst = (uint16_t *)(img->pixels + y * img->stride * sizeof(uint16_t)) + rect->left;
-        memcpy(dst, src, (rect->right - rect->left + 1) * sizeof(uint16_t));
-        src += (rect->right - rect->left + 1);
+    if (!ctx->stats) {
+        return read_input(ctx, buf, len);
+    }
+    int64_t t0 = esp_timer_get_time();
+    len = read_input(ctx, buf, len);
+    *(ctx->reader ? &ctx->stats->read_wait_us : &ctx->stats->read_us) += (uint32_t)(esp_timer_get_time() - t0);
+    ctx->stats->bytes_read += buf ? len : 0;
+    ctx->stats->reads++;
+    return len;
+}
+
+// Store an 8-bit R, G, B (L8: r only) pixel in `format`.
+static void put_pixel(uint8_t *op, jpeg_pixel_format_t format, uint32_t r, uint32_t g, uint32_t b)
+{
+    uint32_t w;
+    switch (format) {
+    case JPEG_PIXEL_FORMAT_RGB565:
+        *(uint16_t *)op = (uint16_t)((r & 0xF8) << 8 | (g & 0xFC) << 3 | b >> 3);
+        break;
+    case JPEG_PIXEL_FORMAT_RGB565_SWAPPED:
+        w = (r & 0xF8) << 8 | (g & 0xFC) << 3 | b >> 3;
+        *(uint16_t *)op = (uint16_t)(w << 8 | w >> 8);
+        break;
+    case JPEG_PIXEL_FORMAT_RGB888:
+        op[0] = (uint8_t)b;
+        op[1] = (uint8_t)g;
+        op[2] = (uint8_t)r;
+        break;
+    case JPEG_PIXEL_FORMAT_ARGB8888:
+        *(uint32_t *)op = 0xFF000000u | r << 16 | g << 8 | b;
+        break;
+    default:
+        *op = (uint8_t)r;
+    }
+}
+
+// Add one source row to the output row(s) it overlaps, writing those it completes.
+static void resample_row(jpeg_resampler_t *rs, const uint8_t *src)
+{
+    uint32_t sw = rs->src_width, dw = rs->dst_width, sh = rs->src_height, dh = rs->dst_height;
+    uint32_t nc = rs->channels;
+
+    const uint32_t *xmap = rs->xmap;
+    uint32_t *hsum = rs->hsum, *vsum = rs->vsum;
+
+    // Horizontal: a source pixel is never wider than an output pixel, it is
+    // split between two at most. The sums stay in registers until the output
+    // pixel is complete.
+    uint32_t *acc = hsum;
+    if (nc == 3) {
+        uint32_t sr = 0, sg = 0, sb = 0;
+        for (uint32_t x = 0; x < sw; ++x, src += 3) {
+            uint32_t m = xmap[x];
+            uint32_t r = src[0], g = src[1], b = src[2];
+            uint32_t w = m & 0xFFFF;
+            sr += r * w;
+            sg += g * w;
+            sb += b * w;
+            if (m >> 16) {
+                acc[0] = sr;
+                acc[1] = sg;
+                acc[2] = sb;
+                acc += 3;
+                w = dw - w;
+                sr = r * w;
+                sg = g * w;
+                sb = b * w;
+            }
+        }
+    } else {
+        uint32_t sl = 0;
+        for (uint32_t x = 0; x < sw; ++x) {
+            uint32_t m = xmap[x], l = src[x];
+            sl += l * (m & 0xFFFF);
+            if (m >> 16) {
+                *acc++ = sl;
+                sl = l * (dw - (m & 0xFFFF));
+            }
+        }
+    }
+
+    // Vertical: this row spans [src_y * dh, (src_y + 1) * dh), output row dst_y [dst_y * sh, (dst_y + 1) * sh)
+    uint32_t pos = rs->src_y++ * dh, end = pos + dh;
+    while (pos < end) {
+        uint32_t edge = (rs->dst_y + 1) * sh;
+        uint32_t w = (end < edge ? end : edge) - pos;
+        for (uint32_t i = 0; i < dw * nc; ++i) {
+            vsum[i] += hsum[i] * w;
+        }
+        pos += w;
+        if (pos < edge) {
+            break;
+        }
+        // Output row complete
+        uint8_t *op = rs->out + (int32_t)rs->dst_y * rs->out_dy;
+        int32_t dx = rs->out_dx;
+        uint64_t recip = rs->recip;
+        jpeg_pixel_format_t format = rs->format;
+        for (uint32_t j = 0; j < dw * nc; j += nc) {
+            uint32_t r = (uint32_t)((vsum[j] * recip + (1ULL << 39)) >> 40);
+            uint32_t g = nc == 3 ? (uint32_t)((vsum[j + 1] * recip + (1ULL << 39)) >> 40) : r;
+            uint32_t b = nc == 3 ? (uint32_t)((vsum[j + 2] * recip + (1ULL << 39)) >> 40) : r;
+            put_pixel(op, format, r, g, b);
+            op += dx;
+        }
+        memset(vsum, 0, dw * nc * sizeof(uint32_t));
+        rs->dst_y++;
+    }
+}
+
+// Copy an MCU into the band, and resample the band once the last MCU of the row is in.
+static void resample_mcu(jpeg_resampler_t *rs, const JDEC *jd, const uint8_t *pixels, const JRECT *rect)
+{
+    unsigned nc = rs->channels;
+    unsigned width = (rect->right - rect->left + 1) * nc, rows = rect->bottom - rect->top + 1;
+    size_t row = (size_t)rs->src_width * nc;
+    uint8_t *dst = rs->band + (rect->left - jd->crop.left) * nc;
+    for (unsigned y = 0; y < rows; ++y) {
+        memcpy(dst + y * row, pixels + y * width, width);
+    }
+    if (rect->right == jd->crop.right) {
+        for (unsigned y = 0; y < rows; ++y) {
+            resample_row(rs, rs->band + y * row);
+        }
     }
-    return 1;
+}
+
+// Called after every MCU written to the frame buffer (or output for the
+// resampler): returning 0 stops the decode with JDR_INTR, in whichever thread
+// runs it.
+static int tj_output(JDEC *jd, void *bitmap, JRECT *rect)
+{
+    const jpeg_decoder_ctx_t *ctx = (const jpeg_decoder_ctx_t *)jd->device;
+    if (ctx->resampler) {
+        resample_mcu(ctx->resampler, jd, (const uint8_t *)bitmap, rect);
+    }
+    return !atomic_load_explicit(ctx->abandon, memory_order_relaxed) && !(ctx->cancel && *ctx->cancel);
+}
+
+static esp_err_t decode_result(JRESULT res, const char *what)
+{
+    if (res == JDR_INTR) {
+        ESP_LOGD("jpeg", "%s cancelled", what);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (res != JDR_OK) {
+        ESP_LOGE("jpeg", "%s failed %d", what, res);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
 }
 
 static void default_options(jpeg_decode_options_t *opts)
@@ -43,89 +413,1630 @@ static void default_options(jpeg_decode_options_t *opts)
     opts->max_height = 0;
     opts->reduce_to_fit = true;
     opts->use_psram = true;
+    opts->huffman_lut = true;
+    opts->parallel = true;
+    opts->pipeline_depth = 0;
+    opts->pipeline_batch = 0;
+    opts->pipeline_stats = NULL;
+    opts->cancel = NULL;
+    opts->input_buffer_size = 0;
+    opts->crop_x = 0;
+    opts->crop_y = 0;
+    opts->crop_width = 0;
+    opts->crop_height = 0;
+    opts->rotation = 0;
+    opts->auto_orient = false;
+    opts->exact_fit = false;
+    opts->format = JPEG_PIXEL_FORMAT_RGB565;
 }
 
-esp_err_t jpeg_decode_file(const char *path, const jpeg_decode_options_t *options, jpeg_image_t *out_image)
+size_t jpeg_pixel_size(jpeg_pixel_format_t format)
 {
-    if (!path || !out_image) {
-        return ESP_ERR_INVALID_ARG;
+    switch (format) {
+    case JPEG_PIXEL_FORMAT_RGB888:
+        return 3;
+    case JPEG_PIXEL_FORMAT_ARGB8888:
+        return 4;
+    case JPEG_PIXEL_FORMAT_L8:
+        return 1;
+    default:
+        return 2;
     }
-    memset(out_image, 0, sizeof(*out_image));
+}
 
-    jpeg_decode_options_t opts;
-    if (options) {
-        opts = *options;
-    } else {
-        default_options(&opts);
+// tjpgd output format and byte order of `format`
+static void set_pixel_format(JDEC *decoder, jpeg_pixel_format_t format)
+{
+    static const uint8_t jd_format[] = {JD_FMT_RGB565, JD_FMT_RGB565, JD_FMT_RGB888, JD_FMT_ARGB8888, JD_FMT_GRAY};
+    decoder->format = jd_format[format];
+    // tjpgd's RGB888 is R, G, B and its ARGB8888 a native word: only 565 and
+    // 888 need their bytes swapped to match LVGL on a little-endian CPU
+    decoder->swap = format == JPEG_PIXEL_FORMAT_RGB565_SWAPPED || format == JPEG_PIXEL_FORMAT_RGB888;
+}
+
+// Largest size with the aspect ratio of width x height within box_width x
+// box_height (0: unbounded), never larger than the picture.
+static void exact_fit_size(uint16_t width, uint16_t height, uint16_t box_width, uint16_t box_height,
+                           uint16_t *out_width, uint16_t *out_height)
+{
+    uint32_t w = width, h = height;
+    if (box_width && w > box_width) {
+        h = ((uint32_t)height * box_width + width / 2) / width;
+        w = box_width;
+    }
+    if (box_height && h > box_height) {
+        w = ((uint32_t)width * box_height + height / 2) / height;
+        h = box_height;
     }
+    *out_width = w ? w : 1;
+    *out_height = h ? h : 1;
+}
 
-    FILE *fp = fopen(path, "rb");
-    if (!fp) {
-        ESP_LOGE("jpeg", "Failed to open %s", path);
-        return ESP_FAIL;
+// Byte steps of pixel x, y of a width x height picture in an image turned as
+// the EXIF `orient` says, with rows of `stride` bytes and pixels of `b` bytes.
+// Returns the offset of pixel 0,0.
+static int32_t orient_steps(uint8_t orient, uint16_t width, uint16_t height, int32_t stride, int32_t b, int32_t *dx,
+                            int32_t *dy)
+{
+    int32_t w = width - 1, h = height - 1;
+    switch (orient) {
+    case 2: *dx = -b; *dy = stride; return w * b;
+    case 3: *dx = -b; *dy = -stride; return w * b + h * stride;
+    case 4: *dx = b; *dy = -stride; return h * stride;
+    case 5: *dx = stride; *dy = b; return 0;
+    case 6: *dx = stride; *dy = -b; return h * b;
+    case 7: *dx = -stride; *dy = -b; return h * b + w * stride;
+    case 8: *dx = -stride; *dy = b; return w * stride;
+    default: *dx = b; *dy = stride; return 0;
     }
+}
 
-    jpeg_decoder_ctx_t ctx = {
-        .file = fp,
-        .image = out_image,
-    };
-    JDEC decoder;
-    JRESULT res = jd_prepare(&decoder, tj_input, ctx.workbuf, sizeof(ctx.workbuf), &ctx);
-    if (res != JDR_OK) {
-        ESP_LOGE("jpeg", "jd_prepare failed %d", res);
-        fclose(fp);
-        return ESP_FAIL;
+// Set up the exact fit of a src_width x src_height window into dec->image,
+// the MCU rows being my pixels high.
+static esp_err_t resampler_create(jpeg_decoder_t *dec, uint16_t src_width, uint16_t src_height, uint16_t dst_width,
+                                  uint16_t dst_height, unsigned my, uint32_t caps)
+{
+    if ((uint64_t)src_width * src_height * 255 > UINT32_MAX) {
+        return ESP_ERR_NOT_SUPPORTED; // the sums of an output pixel would overflow
+    }
+    jpeg_resampler_t *rs = calloc(1, sizeof(*rs));
+    if (!rs) {
+        return ESP_ERR_NO_MEM;
+    }
+    rs->src_width = src_width;
+    rs->src_height = src_height;
+    rs->dst_width = dst_width;
+    rs->dst_height = dst_height;
+    rs->format = dec->image.format;
+    rs->channels = rs->format == JPEG_PIXEL_FORMAT_L8 ? 1 : 3;
+    rs->recip = ((1ULL << 40) + (uint64_t)src_width * src_height / 2) / ((uint64_t)src_width * src_height);
+    rs->band = heap_caps_malloc((size_t)src_width * my * rs->channels, caps);
+    rs->xmap = malloc((size_t)src_width * sizeof(uint32_t));
+    rs->hsum = malloc((size_t)dst_width * rs->channels * sizeof(uint32_t));
+    rs->vsum = calloc((size_t)dst_width * rs->channels, sizeof(uint32_t));
+    // Source pixel x spans [x * dst_width, (x + 1) * dst_width), output pixel j [j * src_width, (j + 1) * src_width)
+    for (uint32_t x = 0, edge = src_width; rs->xmap && x < src_width; ++x) {
+        uint32_t pos = x * dst_width;
+        if (pos + dst_width >= edge) {
+            rs->xmap[x] = 1u << 16 | (edge - pos);
+            edge += src_width;
+        } else {
+            rs->xmap[x] = dst_width;
+        }
+    }
+    int32_t bpp = (int32_t)jpeg_pixel_size(rs->format);
+    rs->out = dec->image.pixels +
+              orient_steps(dec->decoder.orient, dst_width, dst_height, dec->image.stride, bpp, &rs->out_dx, &rs->out_dy);
+    dec->ctx.resampler = rs;
+    return rs->band && rs->xmap && rs->hsum && rs->vsum ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+static void resampler_free(jpeg_resampler_t *rs)
+{
+    if (rs) {
+        free(rs->band);
+        free(rs->xmap);
+        free(rs->hsum);
+        free(rs->vsum);
+        free(rs);
     }
+}
 
-    uint16_t out_width = decoder.width;
-    uint16_t out_height = decoder.height;
+// EXIF orientation code of a picture stored as `exif` says, then turned
+// clockwise by `rotation` degrees.
+static uint8_t output_orientation(uint8_t exif, uint16_t rotation)
+{
+    // Orientation after one more quarter turn clockwise, indexed by the code before
+    static const uint8_t quarter_turn[9] = {6, 6, 7, 8, 5, 2, 3, 4, 1};
+    uint8_t orient = exif >= 1 && exif <= 8 ? exif : 1;
+    for (uint16_t turns = (rotation / 90) % 4; turns; --turns) {
+        orient = quarter_turn[orient];
+    }
+    return orient;
+}
 
-    uint8_t scale = 0;
-    if (opts.reduce_to_fit && (opts.max_width || opts.max_height)) {
-        while (((out_width >> scale) > opts.max_width && opts.max_width) ||
-               ((out_height >> scale) > opts.max_height && opts.max_height)) {
-            if (scale < 3) {
-                scale++;
-            } else {
-                break;
+// The decoder workspace (huffman tables, MCU and IDCT buffers) is hit for every
+// coefficient, keep it in internal SRAM whatever the output buffer placement.
+// The stream input buffer comes out of it too, larger than JD_SZBUF so that
+// the file is read a cluster at a time.
+// Falls back to the bit-serial huffman decoder if the tables do not fit.
+static esp_err_t alloc_workbuf(jpeg_decoder_ctx_t *ctx, bool huffman_lut, uint16_t inbuf_size)
+{
+    ctx->workbuf = NULL;
+    ctx->inbuf_size = inbuf_size > JD_SZBUF ? inbuf_size : INPUT_BUFFER_SIZE;
+    size_t extra = ctx->inbuf_size - JD_SZBUF;
+#if JD_FASTDECODE == 2
+    if (huffman_lut) {
+        ctx->workbuf = heap_caps_malloc(WORKBUF_LUT_SIZE + extra, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (ctx->workbuf) {
+            ctx->workbuf_size = WORKBUF_LUT_SIZE + extra;
+            return ESP_OK;
+        }
+        ESP_LOGW("jpeg", "No internal RAM for huffman tables, using bit-serial decode");
+    }
+#else
+    (void)huffman_lut;
+#endif
+    ctx->workbuf = heap_caps_malloc(WORKBUF_SIZE + extra, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ctx->workbuf_size = WORKBUF_SIZE + extra;
+    return ctx->workbuf ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+// Prepare a decoder on ctx's workspace, with the huffman tables if they fit in it.
+static JRESULT prepare_decoder(JDEC *decoder, jpeg_decoder_ctx_t *ctx)
+{
+    decoder->nolut = ctx->workbuf_size - (ctx->inbuf_size - JD_SZBUF) < TJPGD_WORKSPACE_SIZE;
+    decoder->szbuf = ctx->inbuf_size;
+    return jd_prepare(decoder, tj_input, ctx->workbuf, ctx->workbuf_size, ctx);
+}
+
+// Threads created next by the calling task run on the other core, at the caller's priority.
+static void pthread_cfg_other_core(const char *name)
+{
+#ifdef ESP_PLATFORM
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    cfg.stack_size = WORKER_TASK_STACK;
+    cfg.prio = uxTaskPriorityGet(NULL);
+    cfg.pin_to_core = xPortGetCoreID() ? 0 : 1;
+    cfg.thread_name = name;
+    esp_pthread_set_cfg(&cfg);
+#else
+    (void)name;
+#endif
+}
+
+// The reader task runs on the caller's core one priority level above it: it
+// sleeps in the SD transfers and takes the CPU back only to start the next one.
+static void pthread_cfg_reader(const char *name)
+{
+#ifdef ESP_PLATFORM
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    cfg.stack_size = READER_TASK_STACK;
+    cfg.prio = uxTaskPriorityGet(NULL) + 1;
+    cfg.pin_to_core = xPortGetCoreID();
+    cfg.thread_name = name;
+    esp_pthread_set_cfg(&cfg);
+#else
+    (void)name;
+#endif
+}
+
+static void *reader_task(void *arg)
+{
+    jpeg_reader_t *rd = (jpeg_reader_t *)arg;
+    uint32_t n = 0;
+    while (!atomic_load(&rd->stop)) {
+        if (n - atomic_load_explicit(&rd->consumed, memory_order_acquire) == rd->count) {
+            pthread_mutex_lock(&rd->lock);
+            while (n - atomic_load(&rd->consumed) == rd->count && !atomic_load(&rd->stop)) {
+                pthread_cond_wait(&rd->cond, &rd->lock);
             }
+            pthread_mutex_unlock(&rd->lock);
+            continue;
+        }
+        int64_t t0 = esp_timer_get_time();
+        size_t len = fread(rd->buffers + (n % rd->count) * rd->size, 1, rd->size, rd->file);
+        rd->read_us += (uint32_t)(esp_timer_get_time() - t0);
+        rd->lengths[n % rd->count] = len;
+        pthread_mutex_lock(&rd->lock);
+        atomic_store_explicit(&rd->filled, ++n, memory_order_release);
+        if (len < rd->size) {
+            atomic_store(&rd->eof, true); // end of file or read error, the decoder gets a short read
+        }
+        pthread_cond_broadcast(&rd->cond);
+        pthread_mutex_unlock(&rd->lock);
+        if (len < rd->size) {
+            break;
         }
     }
-    decoder.scale = scale;
-    out_width = decoder.width >> scale;
-    out_height = decoder.height >> scale;
+    return NULL;
+}
 
-    size_t stride = out_width;
-    size_t buffer_size = stride * out_height * sizeof(uint16_t);
-    uint32_t caps = opts.use_psram ? (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) : MALLOC_CAP_8BIT;
-    uint8_t *buffer = heap_caps_malloc(buffer_size, caps);
-    if (!buffer) {
-        ESP_LOGE("jpeg", "Failed to allocate %u bytes", (unsigned)buffer_size);
-        fclose(fp);
-        return ESP_ERR_NO_MEM;
+// Start streaming the rest of the file ahead of the decoder. Returns false,
+// the decoder reading the file itself, when there is no memory or thread for it.
+static bool reader_start(jpeg_decoder_t *dec)
+{
+    jpeg_reader_t *rd = &dec->reader;
+    rd->file = dec->ctx.file;
+    rd->size = dec->ctx.inbuf_size;
+    rd->count = dec->opts.read_ahead < 2 ? 2 : dec->opts.read_ahead > READ_AHEAD_MAX ? READ_AHEAD_MAX : dec->opts.read_ahead;
+    rd->buffers = heap_caps_malloc(rd->count * rd->size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!rd->buffers) {
+        ESP_LOGW("jpeg", "No internal RAM for %u read-ahead buffers", (unsigned)rd->count);
+        return false;
     }
+    atomic_init(&rd->filled, 0);
+    atomic_init(&rd->consumed, 0);
+    atomic_init(&rd->eof, false);
+    atomic_init(&rd->stop, false);
+    pthread_mutex_init(&rd->lock, NULL);
+    pthread_cond_init(&rd->cond, NULL);
+    pthread_cfg_reader("jpeg_read");
+    if (pthread_create(&rd->thread, NULL, reader_task, rd) != 0) {
+        pthread_cond_destroy(&rd->cond);
+        pthread_mutex_destroy(&rd->lock);
+        free(rd->buffers);
+        rd->buffers = NULL;
+        return false;
+    }
+    dec->ctx.reader = rd;
+    dec->reader_started = true;
+    return true;
+}
 
-    out_image->pixels = buffer;
-    out_image->width = out_width;
-    out_image->height = out_height;
-    out_image->stride = stride;
-    out_image->buffer_size = buffer_size;
+static void reader_stop(jpeg_decoder_t *dec)
+{
+    jpeg_reader_t *rd = &dec->reader;
+    pthread_mutex_lock(&rd->lock);
+    atomic_store(&rd->stop, true);
+    pthread_cond_broadcast(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+    pthread_join(rd->thread, NULL);
+    pthread_cond_destroy(&rd->cond);
+    pthread_mutex_destroy(&rd->lock);
+    free(rd->buffers);
+    rd->buffers = NULL;
+    dec->ctx.reader = NULL;
+    dec->reader_started = false;
+    dec->stats.read_us += rd->read_us;
+}
 
-    res = jd_decomp(&decoder, tj_output, scale);
-    fclose(fp);
-    if (res != JDR_OK) {
-        ESP_LOGE("jpeg", "jd_decomp failed %d", res);
-        jpeg_image_release(out_image);
+// Offset of the entropy coded data of the first scan, 0 if not found.
+static size_t find_scan_data(const uint8_t *data, size_t size)
+{
+    size_t pos = 2; // skip SOI
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) {
+            return 0;
+        }
+        uint8_t marker = data[pos + 1];
+        if (marker == 0xFF) { // fill byte
+            pos++;
+            continue;
+        }
+        size_t len = ((size_t)data[pos + 2] << 8) | data[pos + 3];
+        pos += 2 + len;
+        if (marker == 0xDA) {
+            return pos <= size ? pos : 0;
+        }
+    }
+    return 0;
+}
+
+// Walk the entropy coded data once and record, for every part but the first,
+// the offset following the RSTn marker that precedes its first MCU.
+// Returns false if the stream does not hold the expected markers.
+static bool find_restart_offsets(const uint8_t *data, size_t size, size_t scan, jpeg_part_t *parts, size_t nparts, uint16_t nrst)
+{
+    size_t part = 1;
+    uint32_t interval = 0;
+    const uint8_t *p = data + scan;
+    const uint8_t *end = data + size;
+    while (part < nparts && p + 1 < end) {
+        p = memchr(p, 0xFF, end - p - 1);
+        if (!p) {
+            break;
+        }
+        uint8_t m = p[1];
+        if (m >= 0xD0 && m <= 0xD7) {
+            if ((m & 7) != (interval & 7)) {
+                return false;
+            }
+            interval++;
+            if ((uint32_t)interval * nrst == parts[part].first) {
+                parts[part++].offset = (size_t)(p + 2 - data);
+            }
+            p += 2;
+        } else if (m == 0x00 || m == 0xFF) {
+            p++; // stuffed byte or fill
+        } else {
+            break; // EOI or another marker ends the scan
+        }
+    }
+    return part == nparts;
+}
+
+static void *decode_part(void *arg)
+{
+    jpeg_part_t *part = (jpeg_part_t *)arg;
+    JDEC decoder = {0};
+    decoder.orient = part->orient;
+    set_pixel_format(&decoder, part->format);
+    part->res = prepare_decoder(&decoder, &part->ctx);
+    if (part->res != JDR_OK) {
+        return NULL;
+    }
+    if (part->offset) {
+        part->ctx.pos = part->offset;
+    }
+    part->res = jd_decomp_part(&decoder, tj_output, part->dst, part->stride, part->scale, part->first, part->count);
+    return NULL;
+}
+
+// Load the whole file in PSRAM for the parts (dec->data), leaving the file
+// where it was.
+static esp_err_t parallel_load(jpeg_decoder_t *dec, size_t *out_size)
+{
+    FILE *file = dec->ctx.file;
+    long pos = ftell(file);
+    if (pos < 0 || fseek(file, 0, SEEK_END) != 0) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    long size = ftell(file);
+    if (size <= 0 || size > PARALLEL_MAX_FILE_SIZE) {
+        fseek(file, pos, SEEK_SET);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    uint8_t *data = heap_caps_malloc((size_t)size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!data) {
+        fseek(file, pos, SEEK_SET);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    fseek(file, 0, SEEK_SET);
+    int64_t t0 = esp_timer_get_time();
+    bool loaded = fread(data, 1, (size_t)size, file) == (size_t)size;
+    if (dec->ctx.stats) {
+        dec->ctx.stats->read_us += (uint32_t)(esp_timer_get_time() - t0);
+        dec->ctx.stats->bytes_read += (uint32_t)size;
+        dec->ctx.stats->reads++;
+    }
+    if (fseek(file, pos, SEEK_SET) != 0 || !loaded) {
+        free(data);
         return ESP_FAIL;
     }
+    dec->data = data;
+    *out_size = (size_t)size;
     return ESP_OK;
 }
 
-void jpeg_image_release(jpeg_image_t *image)
+// Split an image with restart intervals between both cores: the parts after
+// the first are started on helper threads, the caller's decoder keeps the
+// first one. Returns ESP_ERR_NOT_SUPPORTED, with the file left where it was,
+// when another mode should be used.
+static esp_err_t parallel_start(jpeg_decoder_t *dec)
 {
-    if (!image) {
-        return;
+    JDEC *decoder = &dec->decoder;
+    uint32_t nintervals = (dec->nmcu + decoder->nrst - 1) / decoder->nrst;
+    if (nintervals < PARALLEL_PARTS) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // Decoding from memory already, or the file is loaded for the parts
+    const uint8_t *data = dec->ctx.data;
+    size_t size = dec->ctx.size;
+    if (!data) {
+        esp_err_t err = parallel_load(dec, &size);
+        if (err != ESP_OK) {
+            return err;
+        }
+        data = dec->data;
+    }
+
+    jpeg_part_t *parts = dec->parts;
+    for (size_t i = 0; i < PARALLEL_PARTS; ++i) {
+        parts[i].ctx.data = data;
+        parts[i].ctx.size = size;
+        parts[i].ctx.cancel = dec->ctx.cancel;
+        parts[i].ctx.abandon = &dec->abandon;
+        parts[i].first = (uint32_t)(nintervals * i / PARALLEL_PARTS) * decoder->nrst;
+        parts[i].dst = dec->image.pixels;
+        parts[i].stride = dec->image.stride;
+        parts[i].scale = decoder->scale;
+        parts[i].orient = decoder->orient;
+        parts[i].format = dec->image.format;
+    }
+    size_t scan = find_scan_data(data, size);
+    if (!scan || !find_restart_offsets(data, size, scan, parts, PARALLEL_PARTS, decoder->nrst)) {
+        ESP_LOGW("jpeg", "Restart markers not found, decoding on one core");
+        free(dec->data);
+        dec->data = NULL;
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    size_t nparts = PARALLEL_PARTS;
+    for (size_t i = 1; i < nparts; ++i) {
+        if (alloc_workbuf(&parts[i].ctx, dec->opts.huffman_lut, dec->opts.input_buffer_size) != ESP_OK) {
+            nparts = i;
+            break;
+        }
+    }
+    if (nparts == 1) {
+        free(dec->data);
+        dec->data = NULL;
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    for (size_t i = 0; i < nparts; ++i) {
+        parts[i].count = (i + 1 < nparts ? parts[i + 1].first : dec->nmcu) - parts[i].first;
+    }
+    dec->nparts = nparts;
+    dec->end = parts[1].first;
+
+    pthread_cfg_other_core("jpeg_part"); // the caller decodes the first part
+    dec->started = 1;
+    for (; dec->started < nparts; ++dec->started) {
+        if (pthread_create(&dec->threads[dec->started], NULL, decode_part, &parts[dec->started]) != 0) {
+            break;
+        }
+    }
+    for (size_t i = dec->started; i < nparts; ++i) {
+        decode_part(&parts[i]); // no thread available, run the part inline
+    }
+    return ESP_OK;
+}
+
+// Wait for the helper parts and collect their results.
+static esp_err_t parallel_join(jpeg_decoder_t *dec)
+{
+    for (size_t i = 1; i < dec->started; ++i) {
+        pthread_join(dec->threads[i], NULL);
+    }
+    dec->started = 0;
+    esp_err_t err = ESP_OK;
+    for (size_t i = 1; i < dec->nparts; ++i) {
+        esp_err_t part_err = decode_result(dec->parts[i].res, "jd_decomp_part");
+        if (err == ESP_OK) {
+            err = part_err;
+        }
+        free(dec->parts[i].ctx.workbuf);
+        dec->parts[i].ctx.workbuf = NULL;
+    }
+    dec->nparts = 0;
+    free(dec->data);
+    dec->data = NULL;
+    return err;
+}
+
+// Time the decoder spent in the input callback
+static uint32_t input_us(const jpeg_decode_stats_t *stats)
+{
+    return stats->read_us + stats->read_wait_us;
+}
+
+// IDCT and output of the next MCU, the time of each added to stats.
+static JRESULT output_timed(JDEC *decoder, JBLOCK *blk, jpeg_decode_stats_t *stats)
+{
+    int64_t t0 = esp_timer_get_time();
+    JRESULT res = jd_pipe_idct(decoder, blk);
+    int64_t t1 = esp_timer_get_time();
+    if (res == JDR_OK) {
+        res = jd_pipe_output(decoder, NULL, tj_output);
+    }
+    stats->idct_us += (uint32_t)(t1 - t0);
+    stats->output_us += (uint32_t)(esp_timer_get_time() - t1);
+    return res;
+}
+
+// Publish a stage counter, waking the other stage if it sleeps on it.
+// Sequentially consistent with the sleepers check of pipeline_wait().
+static void pipeline_publish(jpeg_pipeline_t *pipe, atomic_uint_fast32_t *counter, uint32_t value)
+{
+    atomic_store(counter, value);
+    if (atomic_load(&pipe->sleepers)) {
+        pthread_mutex_lock(&pipe->lock);
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+}
+
+// Record the first error of either stage and wake the one that waits.
+static void pipeline_fail(jpeg_pipeline_t *pipe, JRESULT res)
+{
+    int none = JDR_OK;
+    pthread_mutex_lock(&pipe->lock);
+    atomic_compare_exchange_strong(&pipe->error, &none, (int)res);
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// Wait for the other stage to move its counter off `value`, or to fail.
+// Returns the counter. sched_yield() only lets equal or higher priority tasks
+// run, so after PIPELINE_SPIN tries the stage sleeps and leaves the core to the UI.
+static uint32_t pipeline_wait(jpeg_pipeline_t *pipe, atomic_uint_fast32_t *counter, uint32_t value)
+{
+    uint32_t v;
+    for (int i = 0; i < PIPELINE_SPIN; i++) {
+        if ((v = atomic_load_explicit(counter, memory_order_acquire)) != value ||
+            atomic_load_explicit(&pipe->error, memory_order_relaxed)) {
+            return v;
+        }
+        sched_yield();
+    }
+    pthread_mutex_lock(&pipe->lock);
+    atomic_fetch_add(&pipe->sleepers, 1);
+    while ((v = atomic_load(counter)) == value && !atomic_load(&pipe->error)) {
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    }
+    atomic_fetch_sub(&pipe->sleepers, 1);
+    pthread_mutex_unlock(&pipe->lock);
+    return v;
+}
+
+static void *pipeline_output_task(void *arg)
+{
+    jpeg_pipeline_t *pipe = (jpeg_pipeline_t *)arg;
+    int64_t start = esp_timer_get_time();
+    uint32_t done = 0;
+    uint32_t avail = 0;
+    while (done < pipe->nmcu) {
+        if (done == avail) {
+            pipeline_publish(pipe, &pipe->output, done);
+            avail = atomic_load_explicit(&pipe->loaded, memory_order_acquire);
+            if (done == avail) {
+                int64_t t0 = esp_timer_get_time();
+                pipe->stats.output_stalls++;
+                avail = pipeline_wait(pipe, &pipe->loaded, done);
+                pipe->stats.output_wait_us += (uint32_t)(esp_timer_get_time() - t0);
+                if (done == avail) {
+                    break; // the load stage failed or was abandoned
+                }
+            }
+        }
+        JBLOCK *blk = pipe->ring + (done % pipe->depth) * pipe->nblocks;
+        JRESULT res = pipe->timing ? output_timed(pipe->decoder, blk, pipe->timing) : jd_pipe_output(pipe->decoder, blk, tj_output);
+        if (res != JDR_OK) {
+            pipeline_fail(pipe, res);
+            break;
+        }
+        if (++done % pipe->batch == 0) {
+            pipeline_publish(pipe, &pipe->output, done);
+        }
+    }
+    pipeline_publish(pipe, &pipe->output, done);
+    pipe->stats.output_us = (uint32_t)(esp_timer_get_time() - start);
+    return NULL;
+}
+
+// Run the load stage for up to `count` more MCUs. Returns false once it is
+// over, with all MCUs loaded or after an error.
+static bool pipeline_load(jpeg_pipeline_t *pipe, uint32_t count)
+{
+    int64_t start = esp_timer_get_time();
+    uint32_t wait_us = pipe->stats.load_wait_us;
+    uint32_t read_us = pipe->timing ? input_us(pipe->timing) : 0;
+    uint32_t done = pipe->load_done;
+    uint32_t freed = pipe->load_freed;
+    uint32_t stop = count < pipe->nmcu - done ? done + count : pipe->nmcu;
+    bool failed = false;
+    while (done < stop) {
+        if (done - freed == pipe->depth) {
+            pipeline_publish(pipe, &pipe->loaded, done);
+            freed = atomic_load_explicit(&pipe->output, memory_order_acquire);
+            if (done - freed == pipe->depth) {
+                int64_t t0 = esp_timer_get_time();
+                pipe->stats.load_stalls++;
+                freed = pipeline_wait(pipe, &pipe->output, freed);
+                pipe->stats.load_wait_us += (uint32_t)(esp_timer_get_time() - t0);
+                if (done - freed == pipe->depth) {
+                    failed = true; // the output stage failed
+                    break;
+                }
+            }
+        }
+        JRESULT res = jd_pipe_load(pipe->decoder, pipe->ring + (done % pipe->depth) * pipe->nblocks);
+        if (res != JDR_OK) {
+            pipeline_fail(pipe, res);
+            failed = true;
+            break;
+        }
+        if (++done % pipe->batch == 0) {
+            pipeline_publish(pipe, &pipe->loaded, done);
+        }
+    }
+    // Hand everything over before the caller goes away for a while
+    pipeline_publish(pipe, &pipe->loaded, done);
+    pipe->load_done = done;
+    pipe->load_freed = freed;
+    uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+    pipe->stats.load_us += elapsed;
+    if (pipe->timing) {
+        pipe->timing->huffman_us += elapsed - (pipe->stats.load_wait_us - wait_us) - (input_us(pipe->timing) - read_us);
+    }
+    return !failed && done < pipe->nmcu;
+}
+
+// Start the IDCT/output stage on the other core. Returns ESP_ERR_NOT_SUPPORTED,
+// before consuming any input, when the serial path should be used instead.
+static esp_err_t pipeline_start(jpeg_decoder_t *dec)
+{
+    jpeg_pipeline_t *pipe = &dec->pipe;
+    const jpeg_decode_options_t *opts = &dec->opts;
+    pipe->decoder = &dec->decoder;
+    pipe->nblocks = dec->decoder.msx * dec->decoder.msy + 2;
+    pipe->depth = opts->pipeline_depth < 2 ? 2 : opts->pipeline_depth;
+    pipe->batch = opts->pipeline_batch < 1 ? 1 : opts->pipeline_batch > pipe->depth ? pipe->depth : opts->pipeline_batch;
+    pipe->nmcu = dec->nmcu;
+    pipe->stats.mcus = dec->nmcu;
+    pipe->timing = dec->ctx.stats;
+    atomic_init(&pipe->loaded, 0);
+    atomic_init(&pipe->output, 0);
+    atomic_init(&pipe->error, JDR_OK);
+    atomic_init(&pipe->sleepers, 0);
+
+    // Coefficients are touched twice per MCU, keep them in internal RAM
+    int64_t t0 = esp_timer_get_time();
+    pipe->ring = heap_caps_malloc(pipe->depth * pipe->nblocks * sizeof(JBLOCK), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    dec->stats.alloc_us += (uint32_t)(esp_timer_get_time() - t0);
+    if (!pipe->ring) {
+        ESP_LOGW("jpeg", "No internal RAM for a %u MCU pipeline", (unsigned)pipe->depth);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    pthread_cfg_other_core("jpeg_idct");
+    if (pthread_create(&dec->pipe_thread, NULL, pipeline_output_task, pipe) != 0) {
+        pthread_cond_destroy(&pipe->cond);
+        pthread_mutex_destroy(&pipe->lock);
+        free(pipe->ring);
+        pipe->ring = NULL;
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    dec->pipe_started = true;
+    return ESP_OK;
+}
+
+// Stop the output stage, right away if the load stage did not complete.
+static esp_err_t pipeline_join(jpeg_decoder_t *dec)
+{
+    jpeg_pipeline_t *pipe = &dec->pipe;
+    if (pipe->load_done < pipe->nmcu) {
+        pipeline_fail(pipe, JDR_INTR);
+    }
+    pthread_join(dec->pipe_thread, NULL);
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+    dec->pipe_started = false;
+    free(pipe->ring);
+    pipe->ring = NULL;
+
+    esp_err_t err = decode_result((JRESULT)atomic_load(&pipe->error), "pipelined decode");
+    if (err != ESP_OK) {
+        return err;
+    }
+    ESP_LOGD("jpeg", "pipeline %u MCUs: load %u us (waited %u us, %u stalls), output %u us (waited %u us, %u stalls)",
+             (unsigned)pipe->stats.mcus, (unsigned)pipe->stats.load_us, (unsigned)pipe->stats.load_wait_us,
+             (unsigned)pipe->stats.load_stalls, (unsigned)pipe->stats.output_us, (unsigned)pipe->stats.output_wait_us,
+             (unsigned)pipe->stats.output_stalls);
+    if (dec->opts.pipeline_stats) {
+        *dec->opts.pipeline_stats = pipe->stats;
+    }
+    return ESP_OK;
+}
+
+// Image buffer pool, shared by every decoder. Taken by the decoding task and
+// released by whichever task shows the image, hence the lock.
+static struct {
+    pthread_mutex_t lock;
+    bool ready;
+    uint32_t caps;
+    uint8_t count;
+    uint32_t misses;
+    jpeg_pool_class_state_t classes[JPEG_POOL_MAX_CLASSES];
+} s_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Add a slab to the class, with the pool locked
+static bool pool_grow(jpeg_pool_class_state_t *c)
+{
+    uint16_t n = c->max_count - c->stats.count;
+    if (n > c->slab_count) {
+        n = c->slab_count;
+    }
+    if (!n || c->nslabs == POOL_MAX_SLABS) {
+        return false;
+    }
+    uint8_t *slab = heap_caps_malloc(n * c->stride + POOL_ALIGN - 1, s_pool.caps);
+    if (!slab) {
+        ESP_LOGW("jpeg", "Failed to grow the %u-byte image pool by %u buffers", (unsigned)c->stats.buffer_size, n);
+        return false;
+    }
+    c->slabs[c->nslabs] = slab;
+    c->slab_len[c->nslabs++] = n;
+    uint8_t *base = slab + (-(uintptr_t)slab & (POOL_ALIGN - 1));
+    for (uint16_t i = n; i-- > 0;) {
+        c->free[c->nfree++] = base + i * c->stride;
+    }
+    c->stats.count += n;
+    return true;
+}
+
+static void pool_free_classes(void)
+{
+    for (uint8_t i = 0; i < s_pool.count; ++i) {
+        jpeg_pool_class_state_t *c = &s_pool.classes[i];
+        for (uint16_t j = 0; j < c->nslabs; ++j) {
+            free(c->slabs[j]);
+        }
+        free(c->free);
+    }
+    memset(s_pool.classes, 0, sizeof(s_pool.classes));
+    s_pool.count = 0;
+    s_pool.misses = 0;
+}
+
+esp_err_t jpeg_image_pool_init(const jpeg_pool_class_t *classes, size_t count, bool use_psram)
+{
+    if (!classes || !count || count > JPEG_POOL_MAX_CLASSES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (!classes[i].buffer_size || !classes[i].slab_count) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    pthread_mutex_lock(&s_pool.lock);
+    if (s_pool.ready) {
+        pthread_mutex_unlock(&s_pool.lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_pool.caps = use_psram ? (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) : MALLOC_CAP_8BIT;
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < count && err == ESP_OK; ++i) {
+        jpeg_pool_class_state_t *c = &s_pool.classes[s_pool.count++];
+        c->stride = (classes[i].buffer_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+        c->slab_count = classes[i].slab_count;
+        c->max_count = classes[i].max_count > c->slab_count ? classes[i].max_count : c->slab_count;
+        if (c->max_count > (uint32_t)c->slab_count * POOL_MAX_SLABS) {
+            c->max_count = (uint32_t)c->slab_count * POOL_MAX_SLABS;
+        }
+        c->stats.buffer_size = classes[i].buffer_size;
+        c->free = malloc(c->max_count * sizeof(c->free[0]));
+        if (!c->free || !pool_grow(c)) {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    if (err == ESP_OK) {
+        s_pool.ready = true;
+    } else {
+        pool_free_classes();
+    }
+    pthread_mutex_unlock(&s_pool.lock);
+    return err;
+}
+
+esp_err_t jpeg_image_pool_deinit(void)
+{
+    pthread_mutex_lock(&s_pool.lock);
+    for (uint8_t i = 0; i < s_pool.count; ++i) {
+        if (s_pool.classes[i].stats.in_use) {
+            pthread_mutex_unlock(&s_pool.lock);
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    pool_free_classes();
+    s_pool.ready = false;
+    pthread_mutex_unlock(&s_pool.lock);
+    return ESP_OK;
+}
+
+void jpeg_image_pool_get_stats(jpeg_pool_stats_t *out_stats)
+{
+    if (!out_stats) {
+        return;
+    }
+    memset(out_stats, 0, sizeof(*out_stats));
+    pthread_mutex_lock(&s_pool.lock);
+    for (uint8_t i = 0; i < s_pool.count; ++i) {
+        out_stats->classes[i] = s_pool.classes[i].stats;
+    }
+    out_stats->class_count = s_pool.count;
+    out_stats->misses = s_pool.misses;
+    pthread_mutex_unlock(&s_pool.lock);
+}
+
+// Buffer of the smallest class the image fits in, from the heap if there is
+// none or it is full
+static uint8_t *image_alloc(size_t size, uint32_t caps)
+{
+    pthread_mutex_lock(&s_pool.lock);
+    if (s_pool.ready) {
+        jpeg_pool_class_state_t *best = NULL;
+        for (uint8_t i = 0; i < s_pool.count; ++i) {
+            jpeg_pool_class_state_t *c = &s_pool.classes[i];
+            if (c->stats.buffer_size >= size && (!best || c->stride < best->stride)) {
+                best = c;
+            }
+        }
+        if (best && (best->nfree || pool_grow(best))) {
+            uint8_t *buffer = best->free[--best->nfree];
+            if (++best->stats.in_use > best->stats.high_water) {
+                best->stats.high_water = best->stats.in_use;
+            }
+            best->stats.images++;
+            pthread_mutex_unlock(&s_pool.lock);
+            return buffer;
+        }
+        s_pool.misses++;
+    }
+    pthread_mutex_unlock(&s_pool.lock);
+    return heap_caps_malloc(size, caps);
+}
+
+static void image_free(uint8_t *buffer)
+{
+    pthread_mutex_lock(&s_pool.lock);
+    for (uint8_t i = 0; i < s_pool.count; ++i) {
+        jpeg_pool_class_state_t *c = &s_pool.classes[i];
+        for (uint16_t j = 0; j < c->nslabs; ++j) {
+            if (buffer >= c->slabs[j] && buffer < c->slabs[j] + c->slab_len[j] * c->stride + POOL_ALIGN - 1) {
+                c->free[c->nfree++] = buffer;
+                c->stats.in_use--;
+                pthread_mutex_unlock(&s_pool.lock);
+                return;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s_pool.lock);
+    free(buffer);
+}
+
+static jpeg_decoder_t *decoder_create(const jpeg_decode_options_t *options)
+{
+    int64_t start_us = esp_timer_get_time();
+    jpeg_decoder_t *dec = calloc(1, sizeof(*dec));
+    if (!dec) {
+        return NULL;
+    }
+    dec->start_us = start_us;
+    if (options) {
+        dec->opts = *options;
+    } else {
+        default_options(&dec->opts);
+    }
+    dec->status = ESP_ERR_NOT_FINISHED;
+    atomic_init(&dec->abandon, false);
+    dec->ctx.cancel = dec->opts.cancel;
+    dec->ctx.abandon = &dec->abandon;
+    dec->ctx.stats = dec->opts.stats ? &dec->stats : NULL;
+    return dec;
+}
+
+// Parse the headers from dec->ctx, allocate the image and start the decode.
+// The decoder is freed on failure.
+static esp_err_t decoder_start(jpeg_decoder_t *dec)
+{
+    if (dec->opts.rotation % 90 || dec->opts.rotation >= 360) {
+        ESP_LOGE("jpeg", "Rotation %u is not a multiple of 90 degrees", dec->opts.rotation);
+        jpeg_decoder_finish(dec, NULL);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if ((unsigned)dec->opts.format > JPEG_PIXEL_FORMAT_L8) {
+        ESP_LOGE("jpeg", "Unknown pixel format %d", (int)dec->opts.format);
+        jpeg_decoder_finish(dec, NULL);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (dec->opts.stride_align & (dec->opts.stride_align - 1)) {
+        ESP_LOGE("jpeg", "Stride alignment %u is not a power of two", dec->opts.stride_align);
+        jpeg_decoder_finish(dec, NULL);
+        return ESP_ERR_INVALID_ARG;
+    }
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err = alloc_workbuf(&dec->ctx, dec->opts.huffman_lut, dec->opts.input_buffer_size);
+    dec->stats.alloc_us += (uint32_t)(esp_timer_get_time() - t0);
+    if (err != ESP_OK) {
+        ESP_LOGE("jpeg", "Failed to allocate decoder workspace");
+        jpeg_decoder_finish(dec, NULL);
+        return ESP_ERR_NO_MEM;
+    }
+    JDEC *decoder = &dec->decoder;
+    decoder->orient = output_orientation(dec->orient, dec->opts.rotation);
+    // The resampler takes RGB888 MCUs, prepared for in case it is needed
+    jpeg_pixel_format_t format = dec->opts.format;
+    bool rgb_mcus = dec->opts.exact_fit && format != JPEG_PIXEL_FORMAT_L8 && jpeg_pixel_size(format) < 3;
+    set_pixel_format(decoder, rgb_mcus ? JPEG_PIXEL_FORMAT_RGB888 : format);
+    t0 = esp_timer_get_time();
+    JRESULT res = prepare_decoder(decoder, &dec->ctx);
+    dec->stats.header_us = (uint32_t)(esp_timer_get_time() - t0) - dec->stats.read_us;
+    if (res != JDR_OK) {
+        ESP_LOGE("jpeg", "jd_prepare failed %d", res);
+        jpeg_decoder_finish(dec, NULL);
+        return ESP_FAIL;
+    }
+
+    // Region of the picture to decode, the whole picture by default
+    uint16_t crop_x = 0, crop_y = 0;
+    uint16_t crop_width = decoder->width, crop_height = decoder->height;
+    bool cropped = dec->opts.crop_width && dec->opts.crop_height;
+    if (cropped) {
+        if (dec->opts.crop_x >= decoder->width || dec->opts.crop_y >= decoder->height) {
+            ESP_LOGE("jpeg", "Crop origin %u,%u out of the %ux%u picture", dec->opts.crop_x, dec->opts.crop_y,
+                     decoder->width, decoder->height);
+            jpeg_decoder_finish(dec, NULL);
+            return ESP_ERR_INVALID_ARG;
+        }
+        crop_x = dec->opts.crop_x;
+        crop_y = dec->opts.crop_y;
+        crop_width = dec->opts.crop_width < decoder->width - crop_x ? dec->opts.crop_width : decoder->width - crop_x;
+        crop_height = dec->opts.crop_height < decoder->height - crop_y ? dec->opts.crop_height : decoder->height - crop_y;
+    }
+
+    uint16_t out_width = crop_width;
+    uint16_t out_height = crop_height;
+    // Turned a quarter, the picture's width goes along the output's height
+    bool transposed = decoder->orient >= 5;
+    uint16_t fit_width = transposed ? dec->opts.max_height : dec->opts.max_width;
+    uint16_t fit_height = transposed ? dec->opts.max_width : dec->opts.max_height;
+
+    uint8_t scale = 0;
+    uint16_t exact_width = 0, exact_height = 0; // exact fit target, before turning
+    if (dec->opts.reduce_to_fit && (fit_width || fit_height) && dec->opts.exact_fit) {
+        // The largest reduction that still has the target's pixels, resampled from there
+        exact_fit_size(crop_width, crop_height, fit_width, fit_height, &exact_width, &exact_height);
+        while (scale < 3 && (crop_width >> (scale + 1)) >= exact_width && (crop_height >> (scale + 1)) >= exact_height) {
+            scale++;
+        }
+    } else if (dec->opts.reduce_to_fit && (fit_width || fit_height)) {
+        while (((out_width >> scale) > fit_width && fit_width) ||
+               ((out_height >> scale) > fit_height && fit_height)) {
+            if (scale < 3) {
+                scale++;
+            } else {
+                break;
+            }
+        }
+    }
+    out_width = decoder->width >> scale;
+    out_height = decoder->height >> scale;
+    JRECT window;
+    if (cropped) {
+        // Same region in descaled pixels, at least one pixel and inside the picture
+        window.left = crop_x >> scale < out_width ? crop_x >> scale : out_width - 1;
+        window.top = crop_y >> scale < out_height ? crop_y >> scale : out_height - 1;
+        out_width = crop_width >> scale ? crop_width >> scale : 1;
+        out_height = crop_height >> scale ? crop_height >> scale : 1;
+        if (out_width > (decoder->width >> scale) - window.left) {
+            out_width = (decoder->width >> scale) - window.left;
+        }
+        if (out_height > (decoder->height >> scale) - window.top) {
+            out_height = (decoder->height >> scale) - window.top;
+        }
+        window.right = window.left + out_width - 1;
+        window.bottom = window.top + out_height - 1;
+    }
+
+    // Decoded window, resampled to the exact fit when it differs
+    uint16_t src_width = out_width, src_height = out_height;
+    bool resample = exact_width && (exact_width < src_width || exact_height < src_height);
+    if (resample) {
+        out_width = exact_width < src_width ? exact_width : src_width;
+        out_height = exact_height < src_height ? exact_height : src_height;
+    }
+    uint16_t pic_width = out_width, pic_height = out_height;
+    if (transposed) {
+        out_width = pic_height;
+        out_height = pic_width;
+    }
+
+    size_t row_size = (size_t)out_width * jpeg_pixel_size(format);
+    size_t align = dec->opts.stride_align ? dec->opts.stride_align : 1;
+    size_t stride = dec->opts.dest_stride ? dec->opts.dest_stride : (row_size + align - 1) & ~(align - 1);
+    size_t buffer_size = stride * out_height;
+    uint32_t caps = dec->opts.use_psram ? (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) : MALLOC_CAP_8BIT;
+    uint8_t *buffer = dec->opts.dest;
+    if (buffer) {
+        if (stride < row_size || buffer_size > dec->opts.dest_size) {
+            ESP_LOGE("jpeg", "%ux%u image does not fit the %u-byte buffer of %u-byte rows", out_width, out_height,
+                     (unsigned)dec->opts.dest_size, (unsigned)stride);
+            jpeg_decoder_finish(dec, NULL);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        dec->image.external = true;
+    } else {
+        t0 = esp_timer_get_time();
+        buffer = image_alloc(buffer_size, caps);
+        dec->stats.alloc_us += (uint32_t)(esp_timer_get_time() - t0);
+        if (!buffer) {
+            ESP_LOGE("jpeg", "Failed to allocate %u bytes", (unsigned)buffer_size);
+            jpeg_decoder_finish(dec, NULL);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    dec->image.pixels = buffer;
+    dec->image.width = out_width;
+    dec->image.height = out_height;
+    dec->image.stride = stride;
+    dec->image.buffer_size = buffer_size;
+    dec->image.format = format;
+
+    set_pixel_format(decoder, format);
+    if (resample) {
+        decoder->format = format == JPEG_PIXEL_FORMAT_L8 ? JD_FMT_GRAY : JD_FMT_RGB888;
+        decoder->swap = 0;
+        t0 = esp_timer_get_time();
+        err = resampler_create(dec, src_width, src_height, pic_width, pic_height, (decoder->msy * 8) >> scale, caps);
+        dec->stats.alloc_us += (uint32_t)(esp_timer_get_time() - t0);
+        if (err != ESP_OK) {
+            ESP_LOGE("jpeg", "Failed to set up the resampling of %ux%u to %ux%u", src_width, src_height, pic_width,
+                     pic_height);
+            jpeg_decoder_finish(dec, NULL);
+            return err;
+        }
+    }
+
+    // Colour conversion writes straight into the destination rows, turned as
+    // decoder->orient, no per-MCU copy; the resampler gets the MCUs instead
+    // when there is one.
+    res = jd_decomp_start_crop(decoder, resample ? NULL : buffer, stride, scale,
+                               cropped ? &window : NULL);
+    if (res != JDR_OK) {
+        ESP_LOGE("jpeg", "jd_decomp_start failed %d", res);
+        jpeg_decoder_finish(dec, NULL);
+        return ESP_FAIL;
+    }
+    unsigned mx = decoder->msx * 8, my = decoder->msy * 8;
+    uint32_t rows = (decoder->height + my - 1) / my;
+    // Nothing to decode below the region, nor below the last output row: at
+    // 1/8 a last MCU row of less than 8 pixels has none
+    uint32_t bottom = cropped ? window.bottom : (uint32_t)(decoder->height >> scale) - 1;
+    if ((bottom << scale) / my + 1 < rows) {
+        rows = (bottom << scale) / my + 1;
+    }
+    dec->mcus_per_row = (decoder->width + mx - 1) / mx;
+    dec->nmcu = dec->mcus_per_row * rows;
+    dec->end = dec->nmcu;
+    dec->stats.mcus = dec->nmcu;
+
+    // The restart-interval parts are decoded whole, a region and a resampled
+    // picture (rows in order) go through the serial or pipelined paths.
+    err = ESP_ERR_NOT_SUPPORTED;
+    if (dec->opts.parallel && decoder->nrst && !cropped && !resample) {
+        err = parallel_start(dec);
+        dec->mode = DECODE_PARALLEL;
+    }
+    if (err == ESP_ERR_NOT_SUPPORTED && dec->opts.pipeline_depth) {
+        err = pipeline_start(dec);
+        dec->mode = DECODE_PIPELINED;
+    }
+    if (err == ESP_ERR_NOT_SUPPORTED) {
+        err = ESP_OK;
+        dec->mode = DECODE_SERIAL;
+        if (dec->ctx.stats) {
+            dec->blocks = heap_caps_malloc((decoder->msx * decoder->msy + 2) * sizeof(JBLOCK),
+                                           MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+            err = dec->blocks ? ESP_OK : ESP_ERR_NO_MEM;
+        }
+    }
+    // Not for parallel decodes, whose parts read the file loaded in memory
+    if (err == ESP_OK && dec->mode != DECODE_PARALLEL && dec->opts.read_ahead && dec->ctx.file) {
+        reader_start(dec);
+    }
+    if (err != ESP_OK) {
+        jpeg_decoder_finish(dec, NULL);
+    }
+    return err;
+}
+
+static esp_err_t probe_markers(FILE *fp, jpeg_info_t *info);
+
+esp_err_t jpeg_decoder_begin(const char *path, const jpeg_decode_options_t *options, jpeg_decoder_t **out_decoder)
+{
+    if (!path || !out_decoder) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *out_decoder = NULL;
+
+    jpeg_decoder_t *dec = decoder_create(options);
+    if (!dec) {
+        return ESP_ERR_NO_MEM;
+    }
+    dec->ctx.file = fopen(path, "rb");
+    if (!dec->ctx.file) {
+        ESP_LOGE("jpeg", "Failed to open %s", path);
+        jpeg_decoder_finish(dec, NULL);
+        return ESP_FAIL;
+    }
+    if (dec->opts.auto_orient) {
+        jpeg_info_t info = {.orientation = 1};
+        probe_markers(dec->ctx.file, &info); // a picture without EXIF is shown as stored
+        dec->orient = info.orientation;
+        if (fseek(dec->ctx.file, 0, SEEK_SET) != 0) {
+            jpeg_decoder_finish(dec, NULL);
+            return ESP_FAIL;
+        }
+    }
+    esp_err_t err = decoder_start(dec);
+    if (err == ESP_OK) {
+        *out_decoder = dec;
+    }
+    return err;
+}
+
+// jd_decomp_step() through the pipeline entry points, each stage timed into dec->stats.
+static JRESULT step_timed(jpeg_decoder_t *dec, uint32_t count)
+{
+    jpeg_decode_stats_t *stats = &dec->stats;
+    JRESULT res = JDR_OK;
+    while (count-- && res == JDR_OK) {
+        uint32_t read_us = input_us(stats);
+        int64_t t0 = esp_timer_get_time();
+        res = jd_pipe_load(&dec->decoder, dec->blocks);
+        stats->huffman_us += (uint32_t)(esp_timer_get_time() - t0) - (input_us(stats) - read_us);
+        if (res == JDR_OK) {
+            res = output_timed(&dec->decoder, dec->blocks, stats);
+        }
+    }
+    return res;
+}
+
+esp_err_t jpeg_decoder_step(jpeg_decoder_t *dec, uint16_t rows)
+{
+    if (!dec) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (dec->status != ESP_ERR_NOT_FINISHED) {
+        return dec->status;
+    }
+    uint32_t count = (uint32_t)(rows ? rows : 1) * dec->mcus_per_row;
+
+    if (dec->mode == DECODE_PIPELINED) {
+        if (pipeline_load(&dec->pipe, count)) {
+            return ESP_ERR_NOT_FINISHED;
+        }
+        dec->status = pipeline_join(dec);
+        return dec->status;
+    }
+
+    uint32_t left = dec->end - dec->decoder.ldmcu;
+    JRESULT res = dec->blocks ? step_timed(dec, count < left ? count : left)
+                              : jd_decomp_step(&dec->decoder, tj_output, count < left ? count : left);
+    if (res == JDR_OK && dec->decoder.ldmcu < dec->end) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+    dec->status = decode_result(res, "jd_decomp");
+    if (dec->mode == DECODE_PARALLEL) {
+        esp_err_t err = parallel_join(dec);
+        if (dec->status == ESP_OK) {
+            dec->status = err;
+        }
+    }
+    return dec->status;
+}
+
+esp_err_t jpeg_decoder_finish(jpeg_decoder_t *dec, jpeg_image_t *out_image)
+{
+    if (out_image) {
+        memset(out_image, 0, sizeof(*out_image));
+    }
+    if (!dec) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Abandoned before the end: stop the other core first
+    atomic_store(&dec->abandon, dec->status == ESP_ERR_NOT_FINISHED);
+    if (dec->pipe_started) {
+        pipeline_join(dec);
+    }
+    if (dec->nparts) {
+        parallel_join(dec);
+    }
+    if (dec->reader_started) {
+        reader_stop(dec);
+    }
+
+    esp_err_t err = dec->status == ESP_ERR_NOT_FINISHED ? ESP_ERR_INVALID_STATE : dec->status;
+    if (err == ESP_OK && out_image) {
+        *out_image = dec->image;
+    } else {
+        jpeg_image_release(&dec->image);
+    }
+    free(dec->ctx.workbuf);
+    free(dec->blocks);
+    resampler_free(dec->ctx.resampler);
+    if (dec->ctx.file) {
+        fclose(dec->ctx.file);
+    }
+    if (dec->opts.stats) {
+        dec->stats.total_us = (uint32_t)(esp_timer_get_time() - dec->start_us);
+        *dec->opts.stats = dec->stats;
+    }
+    free(dec);
+    return err;
+}
+
+esp_err_t jpeg_decode_file(const char *path, const jpeg_decode_options_t *options, jpeg_image_t *out_image)
+{
+    if (!path || !out_image) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out_image, 0, sizeof(*out_image));
+
+    jpeg_decoder_t *dec;
+    esp_err_t err = jpeg_decoder_begin(path, options, &dec);
+    if (err != ESP_OK) {
+        return err;
+    }
+    while (jpeg_decoder_step(dec, UINT16_MAX) == ESP_ERR_NOT_FINISHED) {
+    }
+    return jpeg_decoder_finish(dec, out_image);
+}
+
+esp_err_t jpeg_decoder_begin_memory(const uint8_t *data, size_t size, const jpeg_decode_options_t *options,
+                                    jpeg_decoder_t **out_decoder)
+{
+    if (!data || !size || !out_decoder) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *out_decoder = NULL;
+
+    jpeg_decoder_t *dec = decoder_create(options);
+    if (!dec) {
+        return ESP_ERR_NO_MEM;
+    }
+    dec->ctx.data = data;
+    dec->ctx.size = size;
+    if (dec->opts.auto_orient) {
+        jpeg_info_t info;
+        jpeg_probe_memory(data, size, &info); // a picture without EXIF is shown as stored
+        dec->orient = info.orientation;
+    }
+    esp_err_t err = decoder_start(dec);
+    if (err == ESP_OK) {
+        *out_decoder = dec;
+    }
+    return err;
+}
+
+esp_err_t jpeg_decode_memory(const uint8_t *data, size_t size, const jpeg_decode_options_t *options, jpeg_image_t *out_image)
+{
+    if (!out_image) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out_image, 0, sizeof(*out_image));
+
+    jpeg_decoder_t *dec;
+    esp_err_t err = jpeg_decoder_begin_memory(data, size, options, &dec);
+    if (err != ESP_OK) {
+        return err;
+    }
+    while (jpeg_decoder_step(dec, UINT16_MAX) == ESP_ERR_NOT_FINISHED) {
+    }
+    return jpeg_decoder_finish(dec, out_image);
+}
+
+esp_err_t jpeg_file_load(const char *path, jpeg_file_buffer_t *buffer)
+{
+    if (!path || !buffer) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    buffer->size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ESP_LOGE("jpeg", "Failed to open %s", path);
+        return ESP_FAIL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > FILE_BUFFER_MAX_SIZE) {
+        close(fd);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size > buffer->capacity) {
+        size_t capacity = (size + FILE_BUFFER_ALIGN - 1) & ~(size_t)(FILE_BUFFER_ALIGN - 1);
+        free(buffer->data);
+        buffer->capacity = 0;
+        buffer->data = heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!buffer->data) {
+            close(fd);
+            return ESP_ERR_NO_MEM;
+        }
+        buffer->capacity = capacity;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buffer->data + done, size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+    if (done != size) {
+        ESP_LOGE("jpeg", "Short read of %s (%u of %u bytes)", path, (unsigned)done, (unsigned)size);
+        return ESP_FAIL;
+    }
+    buffer->size = size;
+    return ESP_OK;
+}
+
+void jpeg_file_buffer_release(jpeg_file_buffer_t *buffer)
+{
+    if (!buffer) {
+        return;
+    }
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+static bool read_at(FILE *fp, long pos, void *buf, size_t len)
+{
+    return fseek(fp, pos, SEEK_SET) == 0 && fread(buf, 1, len, fp) == len;
+}
+
+// EXIF values are stored in the byte order given by the TIFF header
+static uint16_t exif_u16(const uint8_t *p, bool le)
+{
+    return le ? (uint16_t)(p[0] | p[1] << 8) : (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t exif_u32(const uint8_t *p, bool le)
+{
+    return le ? (uint32_t)exif_u16(p + 2, le) << 16 | exif_u16(p, le) : (uint32_t)exif_u16(p, le) << 16 | exif_u16(p + 2, le);
+}
+
+// Orientation from IFD0 and JPEG thumbnail from IFD1 of an Exif APP1 segment,
+// `tiff` being the file offset of the TIFF header and `size` the bytes left in
+// the segment. Only the IFD entries are read, never the tag data.
+static void probe_exif(FILE *fp, long tiff, uint32_t size, jpeg_info_t *info)
+{
+    uint8_t buf[12];
+    if (size < 8 || !read_at(fp, tiff, buf, 8) || buf[0] != buf[1] || (buf[0] != 'I' && buf[0] != 'M')) {
+        return;
+    }
+    bool le = buf[0] == 'I';
+    if (exif_u16(buf + 2, le) != 42) {
+        return;
+    }
+    uint32_t ifd = exif_u32(buf + 4, le);
+    for (int n = 0; n < 2 && ifd && ifd < size - 2; ++n) {
+        if (!read_at(fp, tiff + ifd, buf, 2)) {
+            return;
+        }
+        uint16_t count = exif_u16(buf, le);
+        if (ifd + 2 + count * 12U + 4 > size) {
+            return;
+        }
+        uint32_t thumb_offset = 0, thumb_size = 0;
+        for (uint16_t i = 0; i < count; ++i) {
+            if (fread(buf, 1, 12, fp) != 12) {
+                return;
+            }
+            uint16_t tag = exif_u16(buf, le);
+            if (n == 0 && tag == 0x0112) { // Orientation, SHORT
+                uint16_t v = exif_u16(buf + 8, le);
+                if (v >= 1 && v <= 8) {
+                    info->orientation = (uint8_t)v;
+                }
+            } else if (n == 1 && tag == 0x0201) { // JPEGInterchangeFormat
+                thumb_offset = exif_u32(buf + 8, le);
+            } else if (n == 1 && tag == 0x0202) { // JPEGInterchangeFormatLength
+                thumb_size = exif_u32(buf + 8, le);
+            }
+        }
+        if (thumb_offset && thumb_size && thumb_offset < size && thumb_size <= size - thumb_offset) {
+            info->thumb_offset = (uint32_t)tiff + thumb_offset;
+            info->thumb_size = thumb_size;
+        }
+        if (fread(buf, 1, 4, fp) != 4) {
+            return;
+        }
+        ifd = exif_u32(buf, le);
+    }
+}
+
+static esp_err_t probe_markers(FILE *fp, jpeg_info_t *info)
+{
+    uint8_t buf[16];
+    if (!read_at(fp, 0, buf, 2) || buf[0] != 0xFF || buf[1] != 0xD8) {
+        return ESP_ERR_NOT_SUPPORTED; // no SOI
+    }
+    bool sof = false;
+    long pos = 2;
+    while (read_at(fp, pos, buf, 4) && buf[0] == 0xFF) {
+        uint8_t marker = buf[1];
+        if (marker == 0xFF) { // fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9) { // SOS or EOI, the headers are over
+            break;
+        }
+        uint16_t len = (uint16_t)(buf[2] << 8 | buf[3]);
+        if (len < 2) {
+            break;
+        }
+        long data = pos + 4;
+        uint16_t dlen = len - 2;
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            // SOFn: P, Y, X, Nf, then Ci, Hi/Vi, Tqi for the first component
+            if (dlen < 9 || !read_at(fp, data, buf, 9)) {
+                return ESP_FAIL;
+            }
+            info->height = (uint16_t)(buf[1] << 8 | buf[2]);
+            info->width = (uint16_t)(buf[3] << 8 | buf[4]);
+            info->components = buf[5];
+            info->sampling_h = buf[7] >> 4;
+            info->sampling_v = buf[7] & 15;
+            info->baseline = marker == 0xC0;
+            info->progressive = (marker & 3) == 2;
+            sof = true;
+        } else if (marker == 0xDD && dlen >= 2) { // DRI
+            if (!read_at(fp, data, buf, 2)) {
+                return ESP_FAIL;
+            }
+            info->restart_interval = (uint16_t)(buf[0] << 8 | buf[1]);
+        } else if (marker == 0xE1 && dlen > 14) { // APP1, "Exif\0\0" then a TIFF header
+            if (read_at(fp, data, buf, 6) && memcmp(buf, "Exif\0\0", 6) == 0) {
+                probe_exif(fp, data + 6, dlen - 6U, info);
+            }
+        } else if (marker == 0xE0 && dlen > 6 && !info->thumb_offset) { // APP0, JFIF extension with a JPEG thumbnail
+            if (read_at(fp, data, buf, 6) && memcmp(buf, "JFXX\0\x10", 6) == 0) {
+                info->thumb_offset = (uint32_t)data + 6;
+                info->thumb_size = dlen - 6U;
+            }
+        }
+        pos = data + dlen;
+    }
+    return sof ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t jpeg_probe_file(const char *path, jpeg_info_t *out_info)
+{
+    if (!path || !out_info) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out_info, 0, sizeof(*out_info));
+    out_info->orientation = 1;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        ESP_LOGE("jpeg", "Failed to open %s", path);
+        return ESP_FAIL;
+    }
+    esp_err_t err = probe_markers(fp, out_info);
+    fclose(fp);
+    return err;
+}
+
+esp_err_t jpeg_probe_memory(const uint8_t *data, size_t size, jpeg_info_t *out_info)
+{
+    if (!data || !out_info) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out_info, 0, sizeof(*out_info));
+    out_info->orientation = 1;
+
+    FILE *fp = fmemopen((void *)data, size, "rb");
+    if (!fp) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = probe_markers(fp, out_info);
+    fclose(fp);
+    return err;
+}
+
+// Decode the thumbnail embedded at [offset, offset + size) of the file. Its few
+// KB are read at once and decoded from memory. The thumbnail has no EXIF of its
+// own, `orientation` is the main picture's.
+static esp_err_t decode_embedded(const char *path, uint32_t offset, uint32_t size, uint8_t orientation,
+                                 const jpeg_decode_options_t *options, jpeg_image_t *out_image)
+{
+    uint8_t *data = malloc(size);
+    if (!data) {
+        return ESP_ERR_NO_MEM;
+    }
+    FILE *fp = fopen(path, "rb");
+    bool loaded = fp && read_at(fp, offset, data, size);
+    if (fp) {
+        fclose(fp);
+    }
+    jpeg_decoder_t *dec = loaded ? decoder_create(options) : NULL;
+    if (!dec) {
+        free(data);
+        return loaded ? ESP_ERR_NO_MEM : ESP_FAIL;
+    }
+    dec->ctx.data = data;
+    dec->ctx.size = size;
+    dec->orient = options->auto_orient ? orientation : 1;
+    esp_err_t err = decoder_start(dec);
+    if (err == ESP_OK) {
+        while (jpeg_decoder_step(dec, UINT16_MAX) == ESP_ERR_NOT_FINISHED) {
+        }
+        err = jpeg_decoder_finish(dec, out_image);
+    }
+    free(data);
+    return err;
+}
+
+esp_err_t jpeg_decode_thumbnail(const char *path, const jpeg_decode_options_t *options, jpeg_image_t *out_image)
+{
+    if (!path || !out_image) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out_image, 0, sizeof(*out_image));
+
+    jpeg_info_t info;
+    bool cropped = options && options->crop_width && options->crop_height;
+    if (!cropped && jpeg_probe_file(path, &info) == ESP_OK && info.thumb_offset) {
+        jpeg_decode_options_t opts;
+        if (options) {
+            opts = *options;
+        } else {
+            default_options(&opts);
+        }
+        // Embedded thumbnails are small already, only reduce those more than
+        // twice the box, unless they are resampled to fit it anyway
+        if (!opts.exact_fit) {
+            opts.max_width = opts.max_width > UINT16_MAX / 2 ? UINT16_MAX : opts.max_width * 2;
+            opts.max_height = opts.max_height > UINT16_MAX / 2 ? UINT16_MAX : opts.max_height * 2;
+        }
+        opts.parallel = false;
+        opts.pipeline_depth = 0;
+        opts.pipeline_stats = NULL;
+        if (decode_embedded(path, info.thumb_offset, info.thumb_size, info.orientation, &opts, out_image) == ESP_OK) {
+            return ESP_OK;
+        }
+        ESP_LOGD("jpeg", "Embedded thumbnail of %s not decodable, decoding the image", path);
+    }
+    return jpeg_decode_file(path, options, out_image);
+}
+
+#ifdef ESP_PLATFORM
+esp_err_t jpeg_decode_draw_buf(const char *path, const jpeg_decode_options_t *options, lv_draw_buf_t *draw_buf)
+{
+    if (!path || !draw_buf || !draw_buf->data || !draw_buf->header.stride) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    jpeg_decode_options_t opts;
+    if (options) {
+        opts = *options;
+    } else {
+        default_options(&opts);
+    }
+    switch (draw_buf->header.cf) {
+    case LV_COLOR_FORMAT_RGB565: opts.format = JPEG_PIXEL_FORMAT_RGB565; break;
+    case LV_COLOR_FORMAT_RGB888: opts.format = JPEG_PIXEL_FORMAT_RGB888; break;
+    case LV_COLOR_FORMAT_XRGB8888:
+    case LV_COLOR_FORMAT_ARGB8888: opts.format = JPEG_PIXEL_FORMAT_ARGB8888; break;
+    case LV_COLOR_FORMAT_L8: opts.format = JPEG_PIXEL_FORMAT_L8; break;
+    default:
+        ESP_LOGE("jpeg", "Draw buffer colour format %d not supported", (int)draw_buf->header.cf);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    // Fit the pixels the buffer holds, whatever size its header was left at
+    uint32_t width = draw_buf->header.stride / jpeg_pixel_size(opts.format);
+    uint32_t height = draw_buf->data_size / draw_buf->header.stride;
+    if (!opts.max_width || opts.max_width > width) {
+        opts.max_width = width > UINT16_MAX ? UINT16_MAX : width;
+    }
+    if (!opts.max_height || opts.max_height > height) {
+        opts.max_height = height > UINT16_MAX ? UINT16_MAX : height;
+    }
+    opts.dest = draw_buf->data;
+    opts.dest_size = draw_buf->data_size;
+    opts.dest_stride = draw_buf->header.stride;
+    jpeg_image_t image;
+    esp_err_t err = jpeg_decode_file(path, &opts, &image);
+    if (err == ESP_OK) {
+        draw_buf->header.w = image.width;
+        draw_buf->header.h = image.height;
+    }
+    return err;
+}
+#endif
+
+void jpeg_image_release(jpeg_image_t *image)
+{
+    if (!image) {
+        return;
+    }
+    if (image->pixels && !image->external) {
+        image_free(image->pixels);
     }
-    free(image->pixels);
     memset(image, 0, sizeof(*image));
 }
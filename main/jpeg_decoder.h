@@ -9,24 +9,227 @@
 extern "C" {
 #endif
 
+// Output pixel formats, laid out as the LVGL colour formats of the same name
+// on the (little-endian) ESP32, so that images can be blended without a
+// conversion pass. tjpgd writes every one of them straight from the colour
+// conversion.
+typedef enum {
+    JPEG_PIXEL_FORMAT_RGB565 = 0,     // native 16-bit RRRRRGGGGGGBBBBB words
+    JPEG_PIXEL_FORMAT_RGB565_SWAPPED, // the same words byte swapped, as SPI panels take them
+    JPEG_PIXEL_FORMAT_RGB888,         // bytes B, G, R
+    JPEG_PIXEL_FORMAT_ARGB8888,       // bytes B, G, R, A, opaque
+    JPEG_PIXEL_FORMAT_L8,             // luminance only, the chroma is not decoded at all
+} jpeg_pixel_format_t;
+
 typedef struct {
     uint16_t width;
     uint16_t height;
-    uint16_t stride;
-    size_t buffer_size;
+    uint32_t stride;    // bytes from one row to the next
+    size_t buffer_size; // stride x height
+    jpeg_pixel_format_t format;
     uint8_t *pixels;
+    bool external;      // pixels are the caller's (jpeg_decode_options_t.dest), jpeg_image_release() leaves them
 } jpeg_image_t;
 
+// Stage timings of the last pipelined decode (see jpeg_decode_options_t.pipeline_depth)
+typedef struct {
+    uint32_t mcus;
+    uint32_t load_us;        // huffman decoding stage, wall time
+    uint32_t load_wait_us;   // time it waited for a free slot in the ring
+    uint32_t load_stalls;
+    uint32_t output_us;      // IDCT and colour conversion stage, wall time
+    uint32_t output_wait_us; // time it waited for a loaded MCU
+    uint32_t output_stalls;
+} jpeg_pipeline_stats_t;
+
+// Where the time of a decode went (jpeg_decode_options_t.stats). read_us is
+// spent in the input callback, SD reads or copies from memory, and the other
+// stages exclude it. With read_ahead, read_us is the reader task's time in
+// the SD reads and read_wait_us the decoder's in the input callback, waiting
+// for (and copying) the data: the rest of read_us was hidden behind decoding.
+// huffman_us, idct_us and output_us are measured per MCU: in a pipelined
+// decode IDCT and output run on the other core, in parallel (restart-interval)
+// decodes the stages are not told apart, they stay 0.
+typedef struct {
+    uint32_t total_us;   // in jpeg_decoder_begin(), _step() and _finish() (or jpeg_decode_file())
+    uint32_t alloc_us;   // allocating the decoder workspace, the image and the resampler
+    uint32_t header_us;  // parsing the markers up to the scan
+    uint32_t read_us;
+    uint32_t read_wait_us;
+    uint32_t huffman_us; // entropy decoding and dequantization
+    uint32_t idct_us;
+    uint32_t output_us;  // colour conversion and writes to the image, resampling included
+    uint32_t bytes_read;
+    uint32_t reads;      // input callback calls
+    uint32_t mcus;
+} jpeg_decode_stats_t;
+
 typedef struct {
     uint16_t max_width;
     uint16_t max_height;
     bool reduce_to_fit;
     bool use_psram;
+    bool huffman_lut; // table-driven huffman decode (JD_FASTDECODE == 2), needs 6 KB more internal RAM
+    bool parallel;    // split images with restart markers (DRI) between both cores
+    uint8_t pipeline_depth; // MCUs between the huffman and IDCT stages on the two cores, 0 decodes on one core
+    uint8_t pipeline_batch; // MCUs handed over at once between the two stages
+    jpeg_pipeline_stats_t *pipeline_stats; // filled after a pipelined decode when set
+    uint16_t input_buffer_size; // bytes read from the file at once, 0 for 4 KB (taken from internal RAM)
+    // Buffers of input_buffer_size bytes (2 to 4) that a task streams the file
+    // into ahead of the decoder, so that the SD transfers overlap decoding; 0
+    // reads in the decoder's task. The reader runs on the caller's core, one
+    // priority level above it. Not used by parallel decodes nor from memory.
+    uint8_t read_ahead;
+    // Region to decode, in picture pixels, clipped to the picture; the whole
+    // picture when crop_width or crop_height is 0. The output image is the
+    // region, reduced to fit max_width x max_height. MCUs left of, right of and
+    // above it are only huffman decoded, the rows below it are not read at all.
+    uint16_t crop_x;
+    uint16_t crop_y;
+    uint16_t crop_width;
+    uint16_t crop_height;
+    // Clockwise turn of the output image in degrees (0, 90, 180 or 270), written
+    // turned by the colour conversion with no extra pass nor buffer. With
+    // auto_orient the picture is first turned as its EXIF orientation tag says.
+    // max_width x max_height and the output size apply to the turned image, the
+    // crop region stays in the pixels of the picture as stored.
+    uint16_t rotation;
+    bool auto_orient;
+    // With reduce_to_fit, fit max_width x max_height exactly instead of at the
+    // nearest power-of-two reduction: the picture keeps its aspect ratio and
+    // touches the box on one side, it is never enlarged. tjpgd decodes at the
+    // reduction just above the target, then each MCU row is area-averaged into
+    // the output rows; no image-sized intermediate buffer. Pictures that need
+    // resampling are not split between the cores (parallel).
+    bool exact_fit;
+    jpeg_pixel_format_t format; // of the output image, RGB565 by default
+    // Rows of the output image start a multiple of stride_align bytes apart
+    // (a power of two, 0 for packed rows), as LVGL draw buffers do with
+    // LV_DRAW_BUF_STRIDE_ALIGN, so that it blits them as they are.
+    uint16_t stride_align;
+    // Decode into the caller's buffer of dest_size bytes instead of
+    // allocating the image, rows dest_stride bytes apart (0 for the image
+    // width, rounded up to stride_align). The decode fails with
+    // ESP_ERR_INVALID_SIZE if the output image does not fit; the buffer must
+    // stay until the decode is finished, jpeg_image_release() does not free it.
+    uint8_t *dest;
+    size_t dest_size;
+    uint32_t dest_stride;
+    const volatile bool *cancel; // when set, the decode stops within an MCU or so once *cancel becomes true
+    jpeg_decode_stats_t *stats;  // filled by jpeg_decoder_finish() when set, whether the decode succeeded or not
 } jpeg_decode_options_t;
 
+// Header fields read by jpeg_probe_file()
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint8_t components;        // 1 grayscale, 3 YCbCr
+    uint8_t sampling_h;        // luma sampling factors, 2x2 for 4:2:0, 2x1 for 4:2:2
+    uint8_t sampling_v;
+    bool baseline;             // SOF0, the only process the decoder handles
+    bool progressive;          // SOF2/6/10/14
+    uint16_t restart_interval; // MCUs per restart interval (DRI), 0 if none
+    uint8_t orientation;       // EXIF orientation 1..8, 1 when absent
+    uint32_t thumb_offset;     // file offset of the embedded JPEG thumbnail (EXIF IFD1 or JFXX), 0 if none
+    uint32_t thumb_size;
+} jpeg_info_t;
+
+// Parse the markers up to the first scan, without allocating nor decoding.
+esp_err_t jpeg_probe_file(const char *path, jpeg_info_t *out_info);
+
+// Step-wise decoding, so that the caller can do other work between MCU rows:
+// jpeg_decoder_begin() parses the headers and allocates the output image,
+// jpeg_decoder_step() decodes about `rows` more MCU rows (8 or 16 pixels each
+// before scaling) and returns ESP_ERR_NOT_FINISHED until the image is complete,
+// jpeg_decoder_finish() hands the image over if it is complete, releases
+// everything otherwise, and frees the decoder in both cases.
+// A cancelled (options->cancel) or abandoned decode ends with ESP_ERR_INVALID_STATE.
+typedef struct jpeg_decoder jpeg_decoder_t;
+
+esp_err_t jpeg_decoder_begin(const char *path, const jpeg_decode_options_t *options, jpeg_decoder_t **out_decoder);
+esp_err_t jpeg_decoder_step(jpeg_decoder_t *decoder, uint16_t rows);
+esp_err_t jpeg_decoder_finish(jpeg_decoder_t *decoder, jpeg_image_t *out_image);
+
+// Whole decode in one call
 esp_err_t jpeg_decode_file(const char *path, const jpeg_decode_options_t *options, jpeg_image_t *out_image);
+
+// A whole JPEG file in memory. jpeg_file_load() reads it with one large read()
+// into the buffer, which is kept and only grown from one file to the next
+// (PSRAM, a multiple of the 512-byte sector): no per-chunk VFS calls during
+// the decode, and a restart-interval parallel decode uses it as is.
+typedef struct {
+    uint8_t *data;
+    size_t size;     // bytes of the file
+    size_t capacity; // bytes allocated
+} jpeg_file_buffer_t;
+
+esp_err_t jpeg_file_load(const char *path, jpeg_file_buffer_t *buffer);
+void jpeg_file_buffer_release(jpeg_file_buffer_t *buffer);
+
+// Same as jpeg_probe_file(), jpeg_decoder_begin() and jpeg_decode_file() on a
+// JPEG file in memory, which must stay there until the decode is finished.
+esp_err_t jpeg_probe_memory(const uint8_t *data, size_t size, jpeg_info_t *out_info);
+esp_err_t jpeg_decoder_begin_memory(const uint8_t *data, size_t size, const jpeg_decode_options_t *options,
+                                    jpeg_decoder_t **out_decoder);
+esp_err_t jpeg_decode_memory(const uint8_t *data, size_t size, const jpeg_decode_options_t *options, jpeg_image_t *out_image);
+
+// Decode the JPEG thumbnail embedded in the EXIF or JFIF headers when there is
+// one, reading only a few KB; it is reduced only if more than twice the size of
+// options->max_width x max_height, or fitted exactly with exact_fit. Falls back to jpeg_decode_file() otherwise,
+// and when options ask for a crop region.
+esp_err_t jpeg_decode_thumbnail(const char *path, const jpeg_decode_options_t *options, jpeg_image_t *out_image);
+
+#ifdef ESP_PLATFORM
+#include "lvgl.h"
+
+// Decode into an LVGL draw buffer (RGB565, RGB888, XRGB8888, ARGB8888 or L8,
+// the output format follows it) at its stride: the picture is fitted into
+// the pixels the buffer holds, and the header takes the size of the image.
+// The rest of the options are as for jpeg_decode_file(), defaults when NULL.
+esp_err_t jpeg_decode_draw_buf(const char *path, const jpeg_decode_options_t *options, lv_draw_buf_t *draw_buf);
+#endif
+
+// Bytes per pixel of an image in `format`
+size_t jpeg_pixel_size(jpeg_pixel_format_t format);
+
 void jpeg_image_release(jpeg_image_t *image);
 
+// Output images drawn from fixed-size buffers instead of the heap, once
+// jpeg_image_pool_init() has run: every class holds buffers of one size,
+// allocated slab_count at a time in one block and never freed, so that
+// decoding picture after picture does not fragment PSRAM. An image takes a
+// buffer of the smallest class it fits in, growing the class by a slab when it
+// is empty, and jpeg_image_release() puts it back. Images that fit no class,
+// or whose class is full, come from the heap as before (misses).
+#define JPEG_POOL_MAX_CLASSES 4
+
+typedef struct {
+    size_t buffer_size;  // bytes of every buffer of the class
+    uint16_t slab_count; // buffers allocated at once, the first slab by jpeg_image_pool_init()
+    uint16_t max_count;  // buffers the class grows to, slab_count if lower
+} jpeg_pool_class_t;
+
+typedef struct {
+    size_t buffer_size;
+    uint16_t count;      // buffers allocated
+    uint16_t in_use;
+    uint16_t high_water; // most buffers in use at once
+    uint32_t images;     // images given a buffer of the class
+} jpeg_pool_class_stats_t;
+
+typedef struct {
+    jpeg_pool_class_stats_t classes[JPEG_POOL_MAX_CLASSES]; // in the order given to jpeg_image_pool_init()
+    uint8_t class_count;
+    uint32_t misses; // images allocated from the heap while the pool was set up
+} jpeg_pool_stats_t;
+
+// The buffers are in PSRAM with use_psram, whatever the decode options ask for.
+// ESP_ERR_INVALID_STATE if the pool is set up already.
+esp_err_t jpeg_image_pool_init(const jpeg_pool_class_t *classes, size_t count, bool use_psram);
+// ESP_ERR_INVALID_STATE while images still hold buffers of the pool
+esp_err_t jpeg_image_pool_deinit(void);
+void jpeg_image_pool_get_stats(jpeg_pool_stats_t *out_stats);
+
 #ifdef __cplusplus
 }
 #endif
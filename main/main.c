@@ -18,6 +18,14 @@ static display_driver_handles_t s_display;
 static void gallery_cb(const gallery_event_t *event, void *user_ctx)
 {
     LV_UNUSED(user_ctx);
+    if (event->id == GALLERY_EVENT_IMAGE_READY && !event->preview) {
+        const jpeg_decode_stats_t *st = &event->stats;
+        ESP_LOGD(TAG, "Image %u decoded in %u us: alloc %u, headers %u, read %u (waited %u, %u bytes, %u calls), "
+                 "huffman %u, idct %u, output %u us, %u MCUs", (unsigned)event->index, (unsigned)st->total_us,
+                 (unsigned)st->alloc_us, (unsigned)st->header_us, (unsigned)st->read_us, (unsigned)st->read_wait_us,
+                 (unsigned)st->bytes_read, (unsigned)st->reads, (unsigned)st->huffman_us, (unsigned)st->idct_us, (unsigned)st->output_us,
+                 (unsigned)st->mcus);
+    }
     ui_handle_gallery_event(event);
 }
 
@@ -19,37 +19,47 @@ typedef struct {
     lv_obj_t *brightness_slider;
     lv_obj_t *slideshow_switch;
     lv_obj_t **thumbnail_imgs;
-    lv_image_dsc_t *thumbnail_dscs;
+    lv_draw_buf_t *thumbnail_bufs;
     size_t thumb_count;
     jpeg_image_t current_image;
-    lv_image_dsc_t current_image_dsc;
+    lv_draw_buf_t current_image_buf;
     uint16_t zoom_factor;
-    uint16_t rotation;
+    bool image_zoomed; // current_image is already the zoomed region (gallery_set_zoom)
+    uint16_t image_scale; // LVGL scale that shows current_image as large as its full-size decode, above 256 for a preview
+    uint16_t rotation;       // viewer rotation, 0.1 degree units as LVGL takes it
+    uint16_t image_rotation; // degrees current_image is already turned by (gallery_set_rotation)
     bool slideshow_toggle_guard;
 } ui_context_t;
 
 static const char *TAG = "ui";
 static ui_context_t s_ui = {0};
 
-static lv_image_dsc_t ui_build_rgb565_image_dsc(const jpeg_image_t *image)
+static lv_color_format_t ui_color_format(jpeg_pixel_format_t format)
 {
-    lv_image_dsc_t dsc = {0};
-    if (!image || !image->pixels) {
-        return dsc;
+    switch (format) {
+    case JPEG_PIXEL_FORMAT_RGB565:
+        return LV_COLOR_FORMAT_RGB565;
+    case JPEG_PIXEL_FORMAT_RGB888:
+        return LV_COLOR_FORMAT_RGB888;
+    case JPEG_PIXEL_FORMAT_ARGB8888:
+        return LV_COLOR_FORMAT_ARGB8888;
+    case JPEG_PIXEL_FORMAT_L8:
+        return LV_COLOR_FORMAT_L8;
+    default:
+        return LV_COLOR_FORMAT_UNKNOWN; // byte-swapped RGB565 goes to the panel, not through LVGL 9.1
+    }
+}
+
+// Wrap a decoded image in a draw buffer, used as the image source as it is:
+// the gallery decodes at LVGL's stride alignment, so no copy nor realignment
+static bool ui_build_image_buf(const jpeg_image_t *image, lv_draw_buf_t *buf)
+{
+    memset(buf, 0, sizeof(*buf));
+    if (!image || !image->pixels || ui_color_format(image->format) == LV_COLOR_FORMAT_UNKNOWN) {
+        return false;
     }
-    uint32_t stride_bytes = (uint32_t)image->stride * sizeof(uint16_t);
-    dsc.header.magic = LV_IMAGE_HEADER_MAGIC;
-    dsc.header.cf = LV_COLOR_FORMAT_RGB565;
-    dsc.header.flags = 0;
-    dsc.header.w = image->width;
-    dsc.header.h = image->height;
-    dsc.header.stride = stride_bytes;
-    dsc.header.reserved_2 = 0;
-    dsc.data_size = (uint32_t)image->buffer_size;
-    dsc.data = (const uint8_t *)image->pixels;
-    dsc.reserved = NULL;
-    dsc.reserved_2 = NULL;
-    return dsc;
+    return lv_draw_buf_init(buf, image->width, image->height, ui_color_format(image->format), image->stride,
+                            image->pixels, (uint32_t)image->buffer_size) == LV_RESULT_OK;
 }
 
 static void ui_show_screen(lv_obj_t *screen)
@@ -72,19 +82,37 @@ static void on_viewer_home(lv_event_t *e)
     ui_show_screen(s_ui.home_screen);
 }
 
+// LVGL scales what the decoder did not: a zoomed region is already twice as large.
+static void ui_apply_zoom(void)
+{
+    uint32_t scale = s_ui.image_zoomed ? s_ui.zoom_factor / 2 : s_ui.zoom_factor;
+    scale = scale * (s_ui.image_scale ? s_ui.image_scale : 256) / 256;
+    lv_image_set_scale_x(s_ui.viewer_image, scale);
+    lv_image_set_scale_y(s_ui.viewer_image, scale);
+}
+
 static void on_viewer_zoom(lv_event_t *e)
 {
     LV_UNUSED(e);
     s_ui.zoom_factor = (s_ui.zoom_factor == 256) ? 512 : 256;
-    lv_image_set_scale_x(s_ui.viewer_image, s_ui.zoom_factor);
-    lv_image_set_scale_y(s_ui.viewer_image, s_ui.zoom_factor);
+    // Scaled preview right away, replaced by a sharper decode of the region when there is one
+    ui_apply_zoom();
+    gallery_set_zoom(s_ui.zoom_factor != 256);
+}
+
+// LVGL turns what the decoder did not.
+static void ui_apply_rotation(void)
+{
+    lv_image_set_rotation(s_ui.viewer_image, (s_ui.rotation + 3600 - s_ui.image_rotation * 10) % 3600);
 }
 
 static void on_viewer_rotate(lv_event_t *e)
 {
     LV_UNUSED(e);
     s_ui.rotation = (s_ui.rotation + 900) % 3600;
-    lv_image_set_rotation(s_ui.viewer_image, s_ui.rotation);
+    // Rotated preview right away, replaced by an image the decoder wrote turned
+    ui_apply_rotation();
+    gallery_set_rotation(s_ui.rotation / 10);
 }
 
 static void on_viewer_gesture(lv_event_t *e)
@@ -182,9 +210,9 @@ static void ui_rebuild_gallery_items(void)
 
     lv_obj_clean(s_ui.gallery_container);
     free(s_ui.thumbnail_imgs);
-    free(s_ui.thumbnail_dscs);
+    free(s_ui.thumbnail_bufs);
     s_ui.thumbnail_imgs = NULL;
-    s_ui.thumbnail_dscs = NULL;
+    s_ui.thumbnail_bufs = NULL;
     s_ui.thumb_count = 0;
 
     size_t count = gallery_image_count();
@@ -193,13 +221,13 @@ static void ui_rebuild_gallery_items(void)
     }
 
     s_ui.thumbnail_imgs = calloc(count, sizeof(lv_obj_t *));
-    s_ui.thumbnail_dscs = calloc(count, sizeof(lv_image_dsc_t));
-    if (!s_ui.thumbnail_imgs || !s_ui.thumbnail_dscs) {
+    s_ui.thumbnail_bufs = calloc(count, sizeof(lv_draw_buf_t));
+    if (!s_ui.thumbnail_imgs || !s_ui.thumbnail_bufs) {
         ESP_LOGE(TAG, "Failed to allocate thumbnail descriptors");
         free(s_ui.thumbnail_imgs);
-        free(s_ui.thumbnail_dscs);
+        free(s_ui.thumbnail_bufs);
         s_ui.thumbnail_imgs = NULL;
-        s_ui.thumbnail_dscs = NULL;
+        s_ui.thumbnail_bufs = NULL;
         return;
     }
 
@@ -212,7 +240,7 @@ static void ui_rebuild_gallery_items(void)
         lv_obj_center(img);
         lv_image_set_src(img, NULL);
         s_ui.thumbnail_imgs[i] = img;
-        memset(&s_ui.thumbnail_dscs[i], 0, sizeof(lv_image_dsc_t));
+        memset(&s_ui.thumbnail_bufs[i], 0, sizeof(lv_draw_buf_t));
 
         lv_obj_t *name = lv_label_create(btn);
         const char *path = gallery_image_path(i);
@@ -346,12 +374,12 @@ void ui_deinit(void)
 
     if (s_ui.current_image.pixels) {
         gallery_release_image(&s_ui.current_image);
-        memset(&s_ui.current_image_dsc, 0, sizeof(s_ui.current_image_dsc));
+        memset(&s_ui.current_image_buf, 0, sizeof(s_ui.current_image_buf));
     }
     free(s_ui.thumbnail_imgs);
-    free(s_ui.thumbnail_dscs);
+    free(s_ui.thumbnail_bufs);
     s_ui.thumbnail_imgs = NULL;
-    s_ui.thumbnail_dscs = NULL;
+    s_ui.thumbnail_bufs = NULL;
     s_ui.thumb_count = 0;
     memset(&s_ui, 0, sizeof(s_ui));
 }
@@ -377,18 +405,22 @@ void ui_handle_gallery_event(const gallery_event_t *event)
     case GALLERY_EVENT_IMAGE_READY:
         if (s_ui.current_image.pixels) {
             gallery_release_image(&s_ui.current_image);
-            memset(&s_ui.current_image_dsc, 0, sizeof(s_ui.current_image_dsc));
+            memset(&s_ui.current_image_buf, 0, sizeof(s_ui.current_image_buf));
         }
         s_ui.current_image = event->image;
-        s_ui.current_image_dsc = ui_build_rgb565_image_dsc(&s_ui.current_image);
-        lv_image_set_src(s_ui.viewer_image, &s_ui.current_image_dsc);
+        s_ui.image_zoomed = event->zoomed;
+        s_ui.image_rotation = event->rotation;
+        s_ui.image_scale = event->scale; // the 1/8 preview is scaled up until the full-size image replaces it
+        lv_image_set_src(s_ui.viewer_image, ui_build_image_buf(&s_ui.current_image, &s_ui.current_image_buf)
+                                                ? &s_ui.current_image_buf : NULL);
+        ui_apply_zoom();
+        ui_apply_rotation();
         ui_show_screen(s_ui.viewer_screen);
         break;
     case GALLERY_EVENT_THUMBNAIL_READY:
-        if (event->index < s_ui.thumb_count && s_ui.thumbnail_imgs && s_ui.thumbnail_dscs) {
-            lv_image_dsc_t *dsc = &s_ui.thumbnail_dscs[event->index];
-            *dsc = ui_build_rgb565_image_dsc(&event->image);
-            lv_image_set_src(s_ui.thumbnail_imgs[event->index], dsc);
+        if (event->index < s_ui.thumb_count && s_ui.thumbnail_imgs && s_ui.thumbnail_bufs) {
+            lv_draw_buf_t *buf = &s_ui.thumbnail_bufs[event->index];
+            lv_image_set_src(s_ui.thumbnail_imgs[event->index], ui_build_image_buf(&event->image, buf) ? buf : NULL);
         }
         break;
     case GALLERY_EVENT_ERROR:
@@ -0,0 +1,19 @@
+/*
+ * Host stand-in for the ESP-IDF header, just enough to build main/jpeg_decoder.c
+ * in tools/tjpgd_bench. Capabilities are ignored, every block comes from malloc().
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+static inline void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    (void)caps;
+    return malloc(size);
+}
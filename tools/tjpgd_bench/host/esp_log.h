@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for the ESP-IDF header, just enough to build main/jpeg_decoder.c
+ * in tools/tjpgd_bench. Errors and warnings go to stderr, the rest is dropped.
+ */
+#pragma once
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ((void)(tag))
+#define ESP_LOGD(tag, fmt, ...) ((void)(tag))
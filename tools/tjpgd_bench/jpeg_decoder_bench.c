@@ -0,0 +1,326 @@
+/*
+ * Host benchmark for main/jpeg_decoder.c.
+ *
+ * Decodes every .jpg/.jpeg file of a directory with the options of the gallery
+ * viewer (RGB565, fitted to the LCD) and reports the best wall time per mode:
+ *   serial ms   jpeg_decode_file() on one thread
+ *   par. ms     restart-interval parallel decode, only for images with DRI
+ *               (jpegtran -restart 1 adds one interval per MCU row)
+ *   pipe ms     two-stage pipeline, huffman and IDCT on two threads
+ *   step ms     jpeg_decoder_step() one MCU row at a time, gallery settings
+ *   mem ms      jpeg_file_load() and jpeg_decode_memory()
+ *   ahead ms    file read ahead by another thread (read_ahead option)
+ *   match       whether the pixels of the modes above are the serial ones
+ *   load/wait   pipeline huffman stage ms, of which waiting for the IDCT
+ *   idct/wait   pipeline IDCT stage ms, of which waiting for the huffman
+ *   1/8 ms      gallery thumbnail decoded from the full image at reduced scale
+ *   thumb ms    jpeg_decode_thumbnail(), the embedded thumbnail if any
+ *   zoom ms     centred half of the picture, as the x2 zoom (crop_* options)
+ *   rot90 ms    turned a quarter by the colour conversion, at the serial scale
+ *   fit         size resampled to fit the LCD exactly (exact_fit option)
+ *   fit ms      time of that decode
+ *   argb ms     ARGB8888 output (format option)
+ *   l8 ms       L8 output (format option)
+ *   MP/s        serial throughput in megapixels of the picture
+ *   peak KB     most heap held at once by a serial decode, image included
+ *   fit KB      same for the fit decode
+ * The heap is counted by wrapping malloc() and friends at link time (-Wl,--wrap).
+ * With --csv the same columns are printed comma-separated.
+ *
+ * usage: jpeg_decoder_bench [--csv] <image dir> [iterations] [pipeline depth] [pipeline batch]
+ */
+#include <dirent.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "jpeg_decoder.h"
+
+#define BENCH_MAX_FILES 64
+#define BENCH_FIT_WIDTH 1024
+#define BENCH_FIT_HEIGHT 600
+#define BENCH_THUMB_WIDTH 192
+#define BENCH_THUMB_HEIGHT 108
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+// Heap bytes in use and the most seen since bench_heap_reset(). Blocks the C
+// library allocates for itself (fopen(), strdup()) are not seen, those it frees
+// may be, so only the difference to the reset matters.
+static atomic_long s_heap_live;
+static atomic_long s_heap_peak;
+
+static void bench_heap_add(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    long size = (long)malloc_usable_size(ptr);
+    long live = atomic_fetch_add(&s_heap_live, size) + size;
+    long peak = atomic_load(&s_heap_peak);
+    while (live > peak && !atomic_compare_exchange_weak(&s_heap_peak, &peak, live)) {
+    }
+}
+
+static void bench_heap_sub(void *ptr)
+{
+    if (ptr) {
+        atomic_fetch_sub(&s_heap_live, (long)malloc_usable_size(ptr));
+    }
+}
+
+void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+    bench_heap_add(ptr);
+    return ptr;
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    void *ptr = __real_calloc(n, size);
+    bench_heap_add(ptr);
+    return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_heap_sub(ptr);
+    void *out = __real_realloc(ptr, size);
+    bench_heap_add(out ? out : (size ? ptr : NULL));
+    return out;
+}
+
+void __wrap_free(void *ptr)
+{
+    bench_heap_sub(ptr);
+    __real_free(ptr);
+}
+
+static long bench_heap_reset(void)
+{
+    long live = atomic_load(&s_heap_live);
+    atomic_store(&s_heap_peak, live);
+    return live;
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int has_jpg_extension(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (!ext) {
+        return 0;
+    }
+    ext++;
+    return strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+typedef enum {
+    MODE_SERIAL,
+    MODE_PARALLEL,
+    MODE_PIPELINE,
+    MODE_STEPPED,
+    MODE_MEMORY,
+    MODE_READ_AHEAD,
+    MODE_MATCH_COUNT, // modes above must give the same pixels
+    MODE_THUMB_SCALED = MODE_MATCH_COUNT,
+    MODE_THUMB,
+    MODE_ZOOM,
+    MODE_ROT90,
+    MODE_FIT,
+    MODE_ARGB8888,
+    MODE_L8,
+    MODE_COUNT,
+} bench_mode_t;
+
+static uint8_t s_pipeline_depth = 8;
+static jpeg_file_buffer_t s_file; // MODE_MEMORY, kept from one file to the next as the gallery does
+static uint8_t s_pipeline_batch = 2;
+
+static esp_err_t decode_best(const char *path, bench_mode_t mode, int iterations, uint64_t *best_ns, size_t *peak,
+                             jpeg_image_t *last, jpeg_pipeline_stats_t *stats, const jpeg_info_t *info)
+{
+    bool thumb = mode == MODE_THUMB_SCALED || mode == MODE_THUMB;
+    jpeg_decode_options_t opts = {
+        .max_width = thumb ? BENCH_THUMB_WIDTH : BENCH_FIT_WIDTH,
+        .max_height = thumb ? BENCH_THUMB_HEIGHT : BENCH_FIT_HEIGHT,
+        .reduce_to_fit = true,
+        .use_psram = true,
+        .huffman_lut = true,
+        .parallel = mode == MODE_PARALLEL || mode == MODE_STEPPED,
+        .pipeline_depth = mode == MODE_PIPELINE || mode == MODE_STEPPED ? s_pipeline_depth : 0,
+        .pipeline_batch = s_pipeline_batch,
+        .read_ahead = mode == MODE_READ_AHEAD ? 2 : 0,
+        .rotation = mode == MODE_ROT90 ? 90 : 0,
+        .exact_fit = mode == MODE_FIT,
+        .format = mode == MODE_ARGB8888 ? JPEG_PIXEL_FORMAT_ARGB8888
+                  : mode == MODE_L8     ? JPEG_PIXEL_FORMAT_L8
+                                        : JPEG_PIXEL_FORMAT_RGB565,
+    };
+    if (mode == MODE_ROT90) { // same scale as the serial decode, the output box turned with the picture
+        opts.max_width = BENCH_FIT_HEIGHT;
+        opts.max_height = BENCH_FIT_WIDTH;
+    }
+    if (mode == MODE_ZOOM) {
+        opts.crop_x = info->width / 4;
+        opts.crop_y = info->height / 4;
+        opts.crop_width = info->width / 2;
+        opts.crop_height = info->height / 2;
+    }
+    jpeg_pipeline_stats_t run = {0};
+    if (mode == MODE_PIPELINE) {
+        opts.pipeline_stats = &run;
+    }
+    *best_ns = UINT64_MAX;
+    *peak = 0;
+    for (int it = 0; it < iterations; ++it) {
+        jpeg_image_release(last);
+        long base = bench_heap_reset();
+        uint64_t t0 = bench_now_ns();
+        esp_err_t err;
+        if (mode == MODE_STEPPED) {
+            jpeg_decoder_t *dec;
+            err = jpeg_decoder_begin(path, &opts, &dec);
+            if (err == ESP_OK) {
+                while (jpeg_decoder_step(dec, 1) == ESP_ERR_NOT_FINISHED) {
+                }
+                err = jpeg_decoder_finish(dec, last);
+            }
+        } else if (mode == MODE_MEMORY) {
+            err = jpeg_file_load(path, &s_file);
+            if (err == ESP_OK) {
+                err = jpeg_decode_memory(s_file.data, s_file.size, &opts, last);
+            }
+        } else if (mode == MODE_THUMB) {
+            err = jpeg_decode_thumbnail(path, &opts, last);
+        } else {
+            err = jpeg_decode_file(path, &opts, last);
+        }
+        uint64_t ns = bench_now_ns() - t0;
+        if (err != ESP_OK) {
+            return err;
+        }
+        long used = atomic_load(&s_heap_peak) - base;
+        if ((size_t)used > *peak) {
+            *peak = (size_t)used;
+        }
+        if (ns < *best_ns) {
+            *best_ns = ns;
+            if (opts.pipeline_stats) {
+                *stats = run;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+int main(int argc, char **argv)
+{
+    int csv = argc > 1 && strcmp(argv[1], "--csv") == 0;
+    if (csv) {
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [--csv] <image dir> [iterations] [pipeline depth] [pipeline batch]\n", argv[0]);
+        return 2;
+    }
+    const char *dir_path = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+    if (argc > 3) {
+        s_pipeline_depth = (uint8_t)atoi(argv[3]);
+    }
+    if (argc > 4) {
+        s_pipeline_batch = (uint8_t)atoi(argv[4]);
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        fprintf(stderr, "cannot open %s\n", dir_path);
+        return 1;
+    }
+    char *names[BENCH_MAX_FILES];
+    size_t count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < BENCH_MAX_FILES) {
+        if (has_jpg_extension(entry->d_name)) {
+            names[count++] = strdup(entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(names[0]), compare_names);
+
+    printf(csv ? "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n"
+               : "%-16s %9s %9s %9s %9s %9s %9s %9s %6s %11s %11s %9s %9s %9s %9s %9s %9s %9s %9s %8s %8s %8s\n",
+           "file", "output", "serial ms", "par. ms", "pipe ms", "step ms", "mem ms", "ahead ms", "match", "load/wait", "idct/wait", "1/8 ms",
+           "thumb ms", "zoom ms", "rot90 ms", "fit", "fit ms", "argb ms", "l8 ms", "MP/s", "peak KB", "fit KB");
+    int failures = 0;
+    for (size_t i = 0; i < count; ++i) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, names[i]);
+        jpeg_image_t images[MODE_COUNT] = {0};
+        uint64_t ns[MODE_COUNT] = {0};
+        size_t peak[MODE_COUNT] = {0};
+        jpeg_pipeline_stats_t stats = {0};
+        jpeg_info_t info;
+        int ok = jpeg_probe_file(path, &info) == ESP_OK;
+        for (int mode = 0; mode < MODE_COUNT && ok; ++mode) {
+            ok = decode_best(path, (bench_mode_t)mode, iterations, &ns[mode], &peak[mode], &images[mode], &stats,
+                             &info) == ESP_OK;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: decode failed\n", names[i]);
+            failures++;
+        } else {
+            int match = 1;
+            for (int mode = 1; mode < MODE_MATCH_COUNT; ++mode) {
+                match &= images[mode].buffer_size == images[0].buffer_size &&
+                         memcmp(images[mode].pixels, images[0].pixels, images[0].buffer_size) == 0;
+            }
+            char size[16], load[24], idct[24];
+            snprintf(size, sizeof(size), "%ux%u", images[0].width, images[0].height);
+            snprintf(load, sizeof(load), "%.1f/%.1f", stats.load_us / 1e3, stats.load_wait_us / 1e3);
+            snprintf(idct, sizeof(idct), "%.1f/%.1f", stats.output_us / 1e3, stats.output_wait_us / 1e3);
+            char fit[16];
+            snprintf(fit, sizeof(fit), "%ux%u", images[MODE_FIT].width, images[MODE_FIT].height);
+            printf(csv ? "%s,%s,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%s,%s,%s,%.2f,%.2f,%.2f,%.2f,%s,%.2f,%.2f,%.2f,%.2f,%.1f,%.1f\n"
+                       : "%-16s %9s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %6s %11s %11s %9.2f %9.2f %9.2f %9.2f %9s %9.2f %9.2f %9.2f "
+                         "%8.2f %8.1f %8.1f\n",
+                   names[i], size, ns[MODE_SERIAL] / 1e6, ns[MODE_PARALLEL] / 1e6, ns[MODE_PIPELINE] / 1e6,
+                   ns[MODE_STEPPED] / 1e6, ns[MODE_MEMORY] / 1e6, ns[MODE_READ_AHEAD] / 1e6, match ? "yes" : "NO", load, idct, ns[MODE_THUMB_SCALED] / 1e6,
+                   ns[MODE_THUMB] / 1e6, ns[MODE_ZOOM] / 1e6, ns[MODE_ROT90] / 1e6, fit, ns[MODE_FIT] / 1e6,
+                   ns[MODE_ARGB8888] / 1e6, ns[MODE_L8] / 1e6,
+                   (double)info.width * info.height * 1e3 / ns[MODE_SERIAL], peak[MODE_SERIAL] / 1024.0,
+                   peak[MODE_FIT] / 1024.0);
+            failures += !match;
+        }
+        for (int mode = 0; mode < MODE_COUNT; ++mode) {
+            jpeg_image_release(&images[mode]);
+        }
+        free(names[i]);
+    }
+    jpeg_file_buffer_release(&s_file);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * Host micro-benchmark for components/tjpgd.
+ *
+ * Decodes every .jpg/.jpeg file of a directory from memory (so that file I/O
+ * does not pollute the figures) into an RGB565 frame buffer, the same way
+ * main/jpeg_decoder.c does on the device, and reports the best time per MCU
+ * over a number of iterations. Define BENCH_OUTPUT_CALLBACK to go through the
+ * per-MCU output callback and a memcpy instead of jd_decomp_to_buffer(), and
+ * BENCH_NOLUT=1 to decode with the huffman lookup tables switched off, and
+ * BENCH_SZBUF to change the size of the stream input buffer (JDEC.szbuf).
+ * The number of input function calls per image is reported as well, with the
+ * throughput in megapixels of the picture per second and the bytes of the work
+ * area taken by the decoder (the frame buffer is not included).
+ * With --csv the same columns are printed comma-separated, for scripts
+ * comparing runs.
+ *
+ * usage: tjpgd_bench [--csv] <image dir> [iterations] [scale]
+ */
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "tjpgd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#else
+#define BENCH_HAVE_TSC 0
+#endif
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "tjpgd_bench"
+#endif
+
+#ifndef BENCH_NOLUT
+#define BENCH_NOLUT 0 /* value of JDEC.nolut, 1 turns the JD_FASTDECODE == 2 huffman tables off */
+#endif
+
+#ifndef BENCH_SZBUF
+#define BENCH_SZBUF 0 /* value of JDEC.szbuf, 0 for JD_SZBUF */
+#endif
+
+#define BENCH_WORKBUF_SIZE 32768
+#define BENCH_MAX_FILES 64
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    uint16_t *frame;
+    uint16_t stride;
+    uint32_t reads; /* calls to the input function */
+} bench_src_t;
+
+typedef struct {
+    uint64_t ns;
+    uint64_t cycles;
+} bench_time_t;
+
+static uint8_t s_workbuf[BENCH_WORKBUF_SIZE] __attribute__((aligned(8)));
+
+static size_t bench_input(JDEC *jd, uint8_t *buf, size_t len)
+{
+    bench_src_t *src = (bench_src_t *)jd->device;
+    size_t avail = src->size - src->pos;
+    src->reads++;
+    if (len > avail) {
+        len = avail;
+    }
+    if (buf) {
+        memcpy(buf, src->data + src->pos, len);
+    }
+    src->pos += len;
+    return len;
+}
+
+#ifdef BENCH_OUTPUT_CALLBACK
+static int bench_output(JDEC *jd, void *bitmap, JRECT *rect)
+{
+    bench_src_t *src = (bench_src_t *)jd->device;
+    const uint16_t *pix = (const uint16_t *)bitmap;
+    size_t w = rect->right - rect->left + 1;
+    for (int y = rect->top; y <= rect->bottom; ++y) {
+        memcpy(src->frame + (size_t)y * src->stride + rect->left, pix, w * sizeof(uint16_t));
+        pix += w;
+    }
+    return 1;
+}
+#endif
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t bench_now_cycles(void)
+{
+#if BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int has_jpg_extension(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (!ext) {
+        return 0;
+    }
+    ext++;
+    return strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static uint8_t *load_file(const char *path, size_t *out_size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *data = size > 0 ? malloc((size_t)size) : NULL;
+    if (data && fread(data, 1, (size_t)size, fp) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *out_size = data ? (size_t)size : 0;
+    return data;
+}
+
+static JRESULT decode_once(bench_src_t *src, uint8_t scale, JDEC *jd, bench_time_t *t)
+{
+    src->pos = 0;
+    src->reads = 0;
+    jd->swap = 0;
+    jd->nolut = BENCH_NOLUT;
+    jd->szbuf = BENCH_SZBUF;
+    jd->format = JD_FMT_RGB565;
+    jd->orient = 0;
+    JRESULT res = jd_prepare(jd, bench_input, s_workbuf, sizeof(s_workbuf), src);
+    if (res != JDR_OK) {
+        return res;
+    }
+    if (!src->frame) {
+        src->frame = malloc((size_t)jd->width * jd->height * sizeof(uint16_t));
+        if (!src->frame) {
+            return JDR_MEM1;
+        }
+    }
+    src->stride = jd->width >> scale;
+    uint64_t t0 = bench_now_ns();
+    uint64_t c0 = bench_now_cycles();
+#ifdef BENCH_OUTPUT_CALLBACK
+    res = jd_decomp(jd, bench_output, scale);
+#else
+    res = jd_decomp_to_buffer(jd, NULL, (uint8_t *)src->frame, (size_t)src->stride * sizeof(uint16_t), scale);
+#endif
+    t->cycles = bench_now_cycles() - c0;
+    t->ns = bench_now_ns() - t0;
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    int csv = argc > 1 && strcmp(argv[1], "--csv") == 0;
+    if (csv) {
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [--csv] <image dir> [iterations] [scale]\n", argv[0]);
+        return 2;
+    }
+    const char *dir_path = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+    int only_scale = argc > 3 ? atoi(argv[3]) : -1;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        fprintf(stderr, "cannot open %s\n", dir_path);
+        return 1;
+    }
+    char *names[BENCH_MAX_FILES];
+    size_t count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < BENCH_MAX_FILES) {
+        if (has_jpg_extension(entry->d_name)) {
+            names[count++] = strdup(entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(names[0]), compare_names);
+
+    printf(csv ? "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n" : "%-24s %-16s %5s %9s %6s %10s %12s %6s %8s %7s\n", "variant", "file",
+           "scale", "size", "mcus", "ns/mcu", "cycles/mcu", "reads", "MP/s", "work B");
+
+    uint64_t total_ns[4] = {0};
+    uint64_t total_cycles[4] = {0};
+    uint64_t total_mcus[4] = {0};
+    uint64_t total_pixels[4] = {0};
+    int failures = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, names[i]);
+        bench_src_t src = {0};
+        src.data = load_file(path, &src.size);
+        if (!src.data) {
+            fprintf(stderr, "cannot read %s\n", path);
+            failures++;
+            continue;
+        }
+        for (int scale = 0; scale <= 3; ++scale) {
+            if (only_scale >= 0 && scale != only_scale) {
+                continue;
+            }
+            JDEC jd;
+            bench_time_t best = {UINT64_MAX, UINT64_MAX};
+            JRESULT res = JDR_OK;
+            for (int it = 0; it < iterations && res == JDR_OK; ++it) {
+                bench_time_t t = {0};
+                res = decode_once(&src, (uint8_t)scale, &jd, &t);
+                if (t.ns < best.ns) {
+                    best = t;
+                }
+            }
+            if (res != JDR_OK) {
+                fprintf(stderr, "%s: decode failed at scale %d (%d)\n", names[i], scale, (int)res);
+                failures++;
+                continue;
+            }
+            unsigned mx = jd.msx * 8, my = jd.msy * 8;
+            uint64_t mcus = (uint64_t)((jd.width + mx - 1) / mx) * ((jd.height + my - 1) / my);
+            char size[16];
+            snprintf(size, sizeof(size), "%ux%u", jd.width, jd.height);
+            uint64_t pixels = (uint64_t)jd.width * jd.height;
+            printf(csv ? "%s,%s,%d,%s,%llu,%.1f,%.1f,%u,%.2f,%u\n" : "%-24s %-16s %5d %9s %6llu %10.1f %12.1f %6u %8.2f %7u\n",
+                   BENCH_VARIANT, names[i], scale, size, (unsigned long long)mcus, (double)best.ns / mcus,
+                   (double)best.cycles / mcus, (unsigned)src.reads, pixels * 1e3 / best.ns,
+                   (unsigned)(sizeof(s_workbuf) - jd.sz_pool));
+            total_ns[scale] += best.ns;
+            total_cycles[scale] += best.cycles;
+            total_mcus[scale] += mcus;
+            total_pixels[scale] += pixels;
+        }
+        free(src.frame);
+        free((void *)src.data);
+        free(names[i]);
+    }
+
+    for (int scale = 0; scale <= 3; ++scale) {
+        if (!total_mcus[scale]) {
+            continue;
+        }
+        printf(csv ? "%s,%s,%d,%s,%llu,%.1f,%.1f,%s,%.2f,%s\n" : "%-24s %-16s %5d %9s %6llu %10.1f %12.1f %6s %8.2f %7s\n",
+               BENCH_VARIANT, "TOTAL", scale, "-", (unsigned long long)total_mcus[scale],
+               (double)total_ns[scale] / total_mcus[scale], (double)total_cycles[scale] / total_mcus[scale], "-",
+               total_pixels[scale] * 1e3 / total_ns[scale], "-");
+    }
+    if (!BENCH_HAVE_TSC && !csv) {
+        printf("(cycle counter unavailable on this host, cycles/mcu reported as 0)\n");
+    }
+    return failures ? 1 : 0;
+}
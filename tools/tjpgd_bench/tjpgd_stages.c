@@ -0,0 +1,270 @@
+/*
+ * Host benchmark of the TJpgDec decoding stages, one at a time.
+ *
+ * The decoder source is included so that its internal stages can be timed
+ * separately: every MCU of an image is first huffman decoded into coefficient
+ * blocks (jd_pipe_load), then all the blocks go through the IDCT into saved
+ * Y/Cb/Cr MCU buffers (block_out), and finally all the MCU buffers go through
+ * the colour conversion into an RGB565 frame buffer (mcu_output). Each stage
+ * reports its best time per MCU over a number of iterations, so that a change
+ * to one stage can be measured without the noise of the others. The colour
+ * conversion writes the frame buffer itself, there is no separate output
+ * stage. MP/s is the throughput of the three stages together, in megapixels
+ * of the picture per second. --csv prints the same columns comma-separated.
+ *
+ * usage: tjpgd_stages [--csv] <image dir> [iterations] [scale]
+ */
+#include "../../components/tjpgd/tjpgd.c"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "tjpgd_stages"
+#endif
+
+#define BENCH_WORKBUF_SIZE 16384
+#define BENCH_MAX_FILES 64
+
+enum {
+    STAGE_HUFFMAN,
+    STAGE_IDCT,
+    STAGE_COLOR,
+    STAGE_COUNT,
+};
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+} bench_src_t;
+
+static uint8_t s_workbuf[BENCH_WORKBUF_SIZE] __attribute__((aligned(8)));
+
+static size_t bench_input(JDEC *jd, uint8_t *buf, size_t len)
+{
+    bench_src_t *src = (bench_src_t *)jd->device;
+    size_t avail = src->size - src->pos;
+    if (len > avail) {
+        len = avail;
+    }
+    if (buf) {
+        memcpy(buf, src->data + src->pos, len);
+    }
+    src->pos += len;
+    return len;
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int has_jpg_extension(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (!ext) {
+        return 0;
+    }
+    ext++;
+    return strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static uint8_t *load_file(const char *path, size_t *out_size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *data = size > 0 ? malloc((size_t)size) : NULL;
+    if (data && fread(data, 1, (size_t)size, fp) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *out_size = data ? (size_t)size : 0;
+    return data;
+}
+
+// Run the three stages over the whole image once, adding each one's time to ns[].
+static JRESULT decode_stages(bench_src_t *src, uint8_t scale, JDEC *jd, uint64_t ns[STAGE_COUNT], uint32_t *out_mcus)
+{
+    src->pos = 0;
+    jd->swap = 0;
+    jd->nolut = 0;
+    jd->szbuf = 0;
+    jd->format = 0;
+    jd->orient = 0;
+    JRESULT res = jd_prepare(jd, bench_input, s_workbuf, sizeof(s_workbuf), src);
+    if (res != JDR_OK) {
+        return res;
+    }
+    uint32_t nmcu = mcu_count(jd);
+    unsigned nby = jd->msx * jd->msy;
+    unsigned nb = nby + (jd->ncomp == 3 ? 2 : 0); // no C blocks in a grayscale image
+    unsigned mx = jd->msx * 8, my = jd->msy * 8, nx = (jd->width + mx - 1) / mx;
+    size_t stride = (size_t)(jd->width >> scale) * JD_BPP(jd->format);
+    uint8_t *frame = malloc(stride * (jd->height >> scale) + JD_BPP(jd->format));
+    JBLOCK *blocks = malloc((size_t)nmcu * nb * sizeof(JBLOCK));
+    jd_yuv_t *yuv = malloc((size_t)nmcu * nb * 64 * sizeof(jd_yuv_t));
+    if (!frame || !blocks || !yuv) {
+        res = JDR_MEM1;
+        goto out;
+    }
+    res = jd_decomp_start(jd, frame, stride, scale);
+    if (res != JDR_OK) {
+        goto out;
+    }
+    nmcu = mcu_end(jd); // at 1/8, a last MCU row of less than 8 pixels has no output row and is not decoded
+
+    uint64_t t0 = bench_now_ns();
+    for (uint32_t m = 0; m < nmcu && res == JDR_OK; ++m) {
+        res = jd_pipe_load(jd, blocks + (size_t)m * nb);
+    }
+    uint64_t t1 = bench_now_ns();
+    if (res != JDR_OK) {
+        goto out;
+    }
+    for (uint32_t m = 0; m < nmcu; ++m) {
+        JBLOCK *blk = blocks + (size_t)m * nb;
+        jd_yuv_t *bp = yuv + (size_t)m * nb * 64;
+        for (unsigned b = 0; b < nb; ++b) {
+            block_out(jd, (b < nby) ? 0 : b - nby + 1, blk[b].coef, blk[b].nz, bp + b * 64);
+        }
+    }
+    uint64_t t2 = bench_now_ns();
+    jd_yuv_t *mcubuf = jd->mcubuf;
+    for (uint32_t m = 0; m < nmcu; ++m) {
+        jd->mcubuf = yuv + (size_t)m * nb * 64;
+        mcu_output(jd, NULL, m % nx * mx, m / nx * my);
+    }
+    uint64_t t3 = bench_now_ns();
+    jd->mcubuf = mcubuf;
+
+    ns[STAGE_HUFFMAN] = t1 - t0;
+    ns[STAGE_IDCT] = t2 - t1;
+    ns[STAGE_COLOR] = t3 - t2;
+    *out_mcus = nmcu;
+out:
+    free(yuv);
+    free(blocks);
+    free(frame);
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    int csv = argc > 1 && strcmp(argv[1], "--csv") == 0;
+    if (csv) {
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [--csv] <image dir> [iterations] [scale]\n", argv[0]);
+        return 2;
+    }
+    const char *dir_path = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+    int only_scale = argc > 3 ? atoi(argv[3]) : -1;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        fprintf(stderr, "cannot open %s\n", dir_path);
+        return 1;
+    }
+    char *names[BENCH_MAX_FILES];
+    size_t count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < BENCH_MAX_FILES) {
+        if (has_jpg_extension(entry->d_name)) {
+            names[count++] = strdup(entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(names[0]), compare_names);
+
+    printf(csv ? "%s,%s,%s,%s,%s,%s,%s,%s\n" : "%-24s %-16s %5s %6s %12s %12s %12s %8s\n", "variant", "file", "scale", "mcus",
+           "huff ns/mcu", "idct ns/mcu", "color ns/mcu", "MP/s");
+
+    uint64_t total_ns[4][STAGE_COUNT] = {{0}};
+    uint64_t total_mcus[4] = {0};
+    uint64_t total_pixels[4] = {0};
+    int failures = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, names[i]);
+        bench_src_t src = {0};
+        src.data = load_file(path, &src.size);
+        if (!src.data) {
+            fprintf(stderr, "cannot read %s\n", path);
+            failures++;
+            continue;
+        }
+        for (int scale = 0; scale <= 3; ++scale) {
+            if (only_scale >= 0 && scale != only_scale) {
+                continue;
+            }
+            JDEC jd;
+            uint64_t best[STAGE_COUNT] = {UINT64_MAX, UINT64_MAX, UINT64_MAX};
+            uint32_t mcus = 0;
+            JRESULT res = JDR_OK;
+            for (int it = 0; it < iterations && res == JDR_OK; ++it) {
+                uint64_t ns[STAGE_COUNT] = {0};
+                res = decode_stages(&src, (uint8_t)scale, &jd, ns, &mcus);
+                for (int s = 0; s < STAGE_COUNT; ++s) {
+                    if (ns[s] < best[s]) {
+                        best[s] = ns[s];
+                    }
+                }
+            }
+            if (res != JDR_OK) {
+                fprintf(stderr, "%s: decode failed at scale %d (%d)\n", names[i], scale, (int)res);
+                failures++;
+                continue;
+            }
+            uint64_t pixels = (uint64_t)jd.width * jd.height;
+            printf(csv ? "%s,%s,%d,%u,%.1f,%.1f,%.1f,%.2f\n" : "%-24s %-16s %5d %6u %12.1f %12.1f %12.1f %8.2f\n",
+                   BENCH_VARIANT, names[i], scale, (unsigned)mcus, (double)best[STAGE_HUFFMAN] / mcus,
+                   (double)best[STAGE_IDCT] / mcus, (double)best[STAGE_COLOR] / mcus,
+                   pixels * 1e3 / (best[STAGE_HUFFMAN] + best[STAGE_IDCT] + best[STAGE_COLOR]));
+            for (int s = 0; s < STAGE_COUNT; ++s) {
+                total_ns[scale][s] += best[s];
+            }
+            total_mcus[scale] += mcus;
+            total_pixels[scale] += pixels;
+        }
+        free((void *)src.data);
+        free(names[i]);
+    }
+
+    for (int scale = 0; scale <= 3; ++scale) {
+        if (!total_mcus[scale]) {
+            continue;
+        }
+        uint64_t ns = total_ns[scale][STAGE_HUFFMAN] + total_ns[scale][STAGE_IDCT] + total_ns[scale][STAGE_COLOR];
+        printf(csv ? "%s,%s,%d,%llu,%.1f,%.1f,%.1f,%.2f\n" : "%-24s %-16s %5d %6llu %12.1f %12.1f %12.1f %8.2f\n",
+               BENCH_VARIANT, "TOTAL", scale, (unsigned long long)total_mcus[scale],
+               (double)total_ns[scale][STAGE_HUFFMAN] / total_mcus[scale],
+               (double)total_ns[scale][STAGE_IDCT] / total_mcus[scale],
+               (double)total_ns[scale][STAGE_COLOR] / total_mcus[scale], total_pixels[scale] * 1e3 / ns);
+    }
+    return failures ? 1 : 0;
+}